@@ -0,0 +1,80 @@
+/*******************************************************************************************************************
+    Request/response round trip between two threads over threading::Sync
+
+    Compares the futex based Sync against the mutex + condition variable implementation it replaced
+    Build and run:
+        g++ -std=c++17 -O2 -pthread -Isrc bench/sync_handoff.cpp -o sync_handoff
+        ./sync_handoff [iterations] [spin_count]
+    Prints the average time of one round trip (two handoffs) in nanoseconds for each implementation
+
+********************************************************************************************************************/
+
+#include "threading.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace
+{
+    //threading::Sync before the futex rewrite
+    class LegacySync
+    {
+    public:
+        explicit LegacySync(uint32_t) : mutex(), cond_var(), cond(false) {}
+
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond_var.wait(lock, [this]()->bool { return cond.load(); });
+            cond.store(false);
+        }
+
+        void wake()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                cond.store(true);
+            }
+            cond_var.notify_one();
+        }
+    private:
+        std::mutex                          mutex;
+        std::condition_variable             cond_var;
+        std::atomic_bool                    cond;
+    };
+
+    template <typename SyncType>
+    double roundTripNs(uint32_t iterations, uint32_t spin_count)
+    {
+        SyncType request(spin_count);
+        SyncType response(spin_count);
+        std::thread responder([&]()
+        {
+            for (uint32_t i = 0; i < iterations; ++i)
+            {
+                request.wait();
+                response.wake();
+            }
+        });
+        const auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iterations; ++i)
+        {
+            request.wake();
+            response.wait();
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        responder.join();
+        return double(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / iterations;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const uint32_t iterations = (argc > 1) ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 100000;
+    const uint32_t spin_count = (argc > 2) ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : 0;
+    if (iterations == 0) { return 1; }
+
+    std::printf("mutex+condvar: %.0f ns\n", roundTripNs<LegacySync>(iterations, spin_count));
+    std::printf("futex (spin %u): %.0f ns\n", spin_count, roundTripNs<threading::Sync>(iterations, spin_count));
+    return 0;
+}
@@ -8,6 +8,22 @@
 #include <memory>
 #include <functional>
 #include <queue>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include <unordered_map>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
 
 /*******************************************************************************************************************
     BRIEF DESCRIPTION OF THE CONTENTS OF THIS HEADER
@@ -16,15 +32,64 @@
         Sync:
             description:
                 Synchronization class that can wait on a thread and can be waken up from another
-                Similar to a binary semaphore
+                Similar to a binary semaphore, built on a single 32-bit atomic (futex on Linux)
+                Optionally spins for a bounded number of iterations before going to sleep
+        SyncPair:
+            description:
+                Two Sync objects used for ping-pong handoff between two threads
+        RcuPointer:
+            description:
+                Publishes immutable snapshots behind a shared_ptr, readers never take a lock
+                Writers swap the snapshot and wait for the readers of the previous epoch to leave before freeing it
+            functions:
+                std::shared_ptr<const T> load() const
+                void store(std::shared_ptr<const T> value)
+        TimerWheel:
+            description:
+                Hierarchical timing wheel with O(1) insert and cancel, NOT thread-safe on its own
         Worker:
             description:
                 Can start a constantly running thread waiting for jobs to execute
+                Delayed and periodic jobs are driven by a TimerWheel on the same thread
+                While idle the thread can spin, then yield, before it parks on a condition variable
+                Keeps queue depth, enqueue-to-start latency and job runtime statistics readable as a snapshot
             functions:
                 void push(const std::function<void()>& job)
+                TimerId schedule(std::chrono::milliseconds delay, const std::function<void()>& job)
+                TimerId schedulePeriodic(std::chrono::milliseconds period, const std::function<void()>& job)
+                bool cancel(TimerId id)
+                void setWaitPolicy(const WaitPolicy& policy)
+                WaitStats waitStats() const
+                Stats stats() const
                 bool start(bool wait_to_start = false)
                 void stop()
+        ThreadPool:
+            description:
+                Fixed number of threads executing jobs from a shared queue in no particular order
+            functions:
+                void push(const std::function<void()>& job)
+                bool start()
+                void stop()
+        Strand:
+            description:
+                Serialized executor on top of a ThreadPool, jobs pushed to the same strand never run concurrently
+                and run in the order they were pushed, different strands run in parallel
+            functions:
+                void push(const std::function<void()>& job)
+        KeyedStrands:
+            description:
+                Set of strands identified by a key (e.g. one per device) sharing the same ThreadPool
+            functions:
+                void push(uint64_t key, const std::function<void()>& job)
+                Strand get(uint64_t key)
+                void erase(uint64_t key)
     functions:
+        cpu_relax:
+            description:
+                Hints the processor that the calling thread is in a spin-wait loop
+        wait_on_address / wake_on_address:
+            description:
+                Sleeps while a 32-bit atomic holds the given value / wakes threads sleeping on it
         wait_for_thread_to_start:
             description:
                 Starts an std::thread and waits for it to start
@@ -35,36 +100,162 @@
 
 namespace threading 
 {
+    /**
+     * Hints the processor that the calling thread is in a spin-wait loop
+     */
+    inline void cpu_relax() noexcept
+    {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_ia32_pause();
+#elif defined(__GNUC__) && (defined(__aarch64__) || defined(__arm__))
+        __asm__ __volatile__("yield");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    namespace detail
+    {
+        /**
+         * Index of the lowest set bit, value MUST NOT be zero
+         */
+        inline uint32_t count_trailing_zeros(uint64_t value) noexcept
+        {
+#if defined(__GNUC__)
+            return static_cast<uint32_t>(__builtin_ctzll(value));
+#else
+            uint32_t count = 0;
+            while ((value & 1) == 0) { value >>= 1; ++count; }
+            return count;
+#endif
+        }
+
+        /**
+         * Number of bits needed to represent the value, zero for zero
+         */
+        inline uint32_t bit_width(uint64_t value) noexcept
+        {
+#if defined(__GNUC__)
+            return value ? static_cast<uint32_t>(64 - __builtin_clzll(value)) : 0;
+#else
+            uint32_t width = 0;
+            while (value) { value >>= 1; ++width; }
+            return width;
+#endif
+        }
+
+#if !defined(__linux__) && !defined(__cpp_lib_atomic_wait)
+        //without futexes or C++20 atomic waits sleepers park on a condition variable picked by address
+        struct ParkingBucket
+        {
+            std::mutex                      mutex;
+            std::condition_variable         cond_var;
+        };
+
+        inline ParkingBucket& parking_bucket(const void* address) noexcept
+        {
+            static ParkingBucket buckets[64];
+            return buckets[(reinterpret_cast<uintptr_t>(address) / sizeof(uint32_t)) % 64];
+        }
+#endif
+    }
+
+    /**
+     * Blocks the calling thread while the given atomic holds the expected value
+     * May return spuriously, callers MUST re-check their condition
+     */
+    inline void wait_on_address(std::atomic<uint32_t>& address, uint32_t expected) noexcept
+    {
+#if defined(__linux__)
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex requires a plain 32-bit word");
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&address), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#elif defined(__cpp_lib_atomic_wait)
+        address.wait(expected);
+#else
+        detail::ParkingBucket& bucket = detail::parking_bucket(&address);
+        std::unique_lock<std::mutex> lock(bucket.mutex);
+        if (address.load() == expected) { bucket.cond_var.wait(lock); }
+#endif
+    }
+
+    /**
+     * Wakes threads blocked in wait_on_address() on the given atomic
+     * @param wake_all If true all waiting threads are woken up, otherwise only one of them
+     */
+    inline void wake_on_address(std::atomic<uint32_t>& address, bool wake_all = false) noexcept
+    {
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&address), FUTEX_WAKE_PRIVATE, wake_all ? INT_MAX : 1, nullptr, nullptr, 0);
+#elif defined(__cpp_lib_atomic_wait)
+        if (wake_all) { address.notify_all(); } else { address.notify_one(); }
+#else
+        //the bucket is shared with other addresses so everybody is woken up, waiters re-check their value
+        (void)wake_all;
+        detail::ParkingBucket& bucket = detail::parking_bucket(&address);
+        { std::lock_guard<std::mutex> lock(bucket.mutex); }
+        bucket.cond_var.notify_all();
+#endif
+    }
+
     class Sync 
     {
     public:
-        Sync() : mutex(), cond_var(), cond(false) {}
+        /**
+         * @param spin_count Number of times wait() polls the state before going to sleep, zero disables spinning
+         */
+        explicit Sync(uint32_t spin_count = 0) : state(0), spin_count(spin_count) {}
 
         void wait()
         {
-            std::unique_lock<std::mutex> lock(mutex);
-            cond_var.wait(lock, [this]()->bool { return cond.load();  });
-            cond.store(false);
+            for (uint32_t i = 0; i < spin_count; ++i)
+            {
+                if (tryConsume()) { return; }
+                cpu_relax();
+            }
+            if (tryConsume()) { return; }
+
+            uint32_t value = state.fetch_add(WAITER) + WAITER;
+            while (true)
+            {
+                if (value & SIGNALED)
+                {
+                    if (state.compare_exchange_weak(value, (value & ~SIGNALED) - WAITER)) { return; }
+                    continue;
+                }
+                wait_on_address(state, value);
+                value = state.load();
+            }
         }
 
         void wake() 
         {
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                cond.store(true);
-            }
-            cond_var.notify_one();
+            const uint32_t prev = state.fetch_or(SIGNALED);
+            //a syscall is only needed if somebody sleeps and nobody has been signaled yet
+            if (((prev & SIGNALED) == 0) && (prev >= WAITER)) { wake_on_address(state); }
         }
     private:
-        std::mutex                          mutex;
-        std::condition_variable             cond_var;
-        std::atomic_bool                    cond;
+        bool tryConsume()
+        {
+            uint32_t value = state.load(std::memory_order_relaxed);
+            return (value & SIGNALED) && state.compare_exchange_strong(value, value & ~SIGNALED, std::memory_order_acquire);
+        }
+        //bit 0: signaled, bits 1-31: number of sleeping waiters
+        static constexpr uint32_t SIGNALED = 1;
+        static constexpr uint32_t WAITER = 2;
+
+        std::atomic<uint32_t>               state;
+        const uint32_t                      spin_count;
     };
 
     class SyncPair 
     {
     public:
-        SyncPair() : first(), second() {}
+        /**
+         * @param spin_count Number of polls before sleeping, see Sync
+         */
+        explicit SyncPair(uint32_t spin_count = 0) : first(spin_count), second(spin_count) {}
 
         void waitForFirst() 
         {
@@ -82,21 +273,417 @@ namespace threading
         Sync second;
     };
 
+    template <typename T>
+    class RcuPointer
+    {
+    public:
+        explicit RcuPointer(std::shared_ptr<const T> value = nullptr) : current(new Slot{std::move(value)}), epoch(0), readers{}, writer_mutex() {}
+        ~RcuPointer() { delete current.load(); }
+        RcuPointer(const RcuPointer&) = delete;
+        RcuPointer& operator=(const RcuPointer&) = delete;
+        /**
+         * Returns the current snapshot, lock-free, the only shared writes are the reader counter and the refcount
+         */
+        std::shared_ptr<const T> load() const
+        {
+            uint64_t entered;
+            while (true)
+            {
+                entered = epoch.load();
+                readers[entered & 1].fetch_add(1);
+                //if a writer flipped the epoch meanwhile it may not have waited for us, register again
+                if (epoch.load() == entered) { break; }
+                readers[entered & 1].fetch_sub(1);
+            }
+            std::shared_ptr<const T> value = current.load()->value;
+            readers[entered & 1].fetch_sub(1);
+            return value;
+        }
+        /**
+         * Publishes a new snapshot, concurrent writers are serialized
+         * Waits only for the readers that entered before the swap, later readers see the new snapshot
+         */
+        void store(std::shared_ptr<const T> value)
+        {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            Slot* previous = current.exchange(new Slot{std::move(value)});
+            const uint64_t retired = epoch.fetch_add(1);
+            while (readers[retired & 1].load() != 0) { cpu_relax(); }
+            delete previous;
+        }
+    private:
+        struct Slot
+        {
+            std::shared_ptr<const T>            value;
+        };
+        std::atomic<Slot*>                      current;
+        std::atomic<uint64_t>                   epoch;
+        mutable std::atomic<uint32_t>           readers[2];
+        std::mutex                              writer_mutex;
+    };
+
+    class TimerWheel
+    {
+    public:
+        typedef uint64_t TimerId;
+        typedef std::shared_ptr<std::function<void()>> Job;
+        static constexpr TimerId INVALID_TIMER = 0;
+        static constexpr uint64_t NO_TICK = UINT64_MAX;
+
+        TimerWheel() : current(0), count(0), nodes(), free_nodes(), heads(), occupied() { clear(); }
+        /**
+         * Inserts a timer
+         * @param expiry Tick at which the job expires, ticks in the past expire on the next advance()
+         * @param period If non-zero the timer is rescheduled by this many ticks each time it expires
+         * @return An identifier usable with cancel()
+         */
+        TimerId insert(uint64_t expiry, uint64_t period, const Job& job)
+        {
+            uint32_t index;
+            if (free_nodes.empty())
+            {
+                index = static_cast<uint32_t>(nodes.size());
+                nodes.emplace_back();
+            }
+            else
+            {
+                index = free_nodes.back();
+                free_nodes.pop_back();
+            }
+            Node& node = nodes[index];
+            node.expiry = (expiry > current) ? expiry : (current + 1);
+            node.period = period;
+            node.job = job;
+            node.active = true;
+            link(index);
+            ++count;
+            return (uint64_t(node.generation) << 32) | (uint64_t(index) + 1);
+        }
+        /**
+         * Cancels a pending timer
+         * @return True is returned if the timer was pending, otherwise false
+         */
+        bool cancel(TimerId id)
+        {
+            const uint64_t index = (id & 0xFFFFFFFFu);
+            if ((index == 0) || (index > nodes.size())) { return false; }
+            Node& node = nodes[index - 1];
+            if (!node.active || (node.generation != uint32_t(id >> 32))) { return false; }
+            unlink(static_cast<uint32_t>(index - 1));
+            release(static_cast<uint32_t>(index - 1));
+            return true;
+        }
+        /**
+         * Advances the wheel up to the given tick
+         * @param expired Jobs of the expired timers are appended to it, periodic timers are rescheduled
+         */
+        void advance(uint64_t tick, std::vector<Job>& expired)
+        {
+            if (count == 0)
+            {
+                if (tick > current) { current = tick; }
+                return;
+            }
+            while (current < tick)
+            {
+                ++current;
+                //cascade timers from the upper levels whenever a lower level wraps around
+                for (uint32_t level = 1; level < LEVELS; ++level)
+                {
+                    if ((current & ((uint64_t(1) << (level * SLOT_BITS)) - 1)) != 0) { break; }
+                    uint32_t index = detach(level, slotOf(current, level));
+                    while (index != NIL)
+                    {
+                        const uint32_t next = nodes[index].next;
+                        link(index);
+                        index = next;
+                    }
+                }
+                uint32_t index = detach(0, slotOf(current, 0));
+                while (index != NIL)
+                {
+                    Node& node = nodes[index];
+                    const uint32_t next = node.next;
+                    expired.emplace_back(node.job);
+                    if (node.period > 0)
+                    {
+                        node.expiry = current + node.period;
+                        link(index);
+                    }
+                    else
+                    {
+                        release(index);
+                    }
+                    index = next;
+                }
+                if (count == 0)
+                {
+                    current = tick;
+                }
+            }
+        }
+        /**
+         * Returns the tick at which advance() has to be called next, or NO_TICK if there are no timers
+         * The returned tick may precede the first expiry if timers have to be cascaded first
+         */
+        uint64_t nextTick() const
+        {
+            uint64_t result = NO_TICK;
+            for (uint32_t level = 0; level < LEVELS; ++level)
+            {
+                if (occupied[level] == 0) { continue; }
+                const uint64_t position = (current >> (level * SLOT_BITS)) + 1;
+                const uint32_t shift = static_cast<uint32_t>(position & SLOT_MASK);
+                const uint64_t rotated = shift ? ((occupied[level] >> shift) | (occupied[level] << (SLOTS - shift))) : occupied[level];
+                const uint64_t tick = (position + detail::count_trailing_zeros(rotated)) << (level * SLOT_BITS);
+                if (tick < result) { result = tick; }
+            }
+            return result;
+        }
+        /**
+         * Removes all timers, identifiers issued before stay invalid and never match a later timer
+         */
+        void clear()
+        {   //nodes are kept so their generations keep increasing
+            free_nodes.clear();
+            for (uint32_t index = static_cast<uint32_t>(nodes.size()); index-- > 0;)
+            {
+                Node& node = nodes[index];
+                if (node.active)
+                {
+                    node.job.reset();
+                    node.active = false;
+                    ++node.generation;
+                }
+                node.prev = node.next = node.bucket = NIL;
+                free_nodes.push_back(index);
+            }
+            count = 0;
+            for (auto& head : heads) { head = NIL; }
+            for (auto& bits : occupied) { bits = 0; }
+        }
+        size_t size() const { return count; }
+    private:
+        static constexpr uint32_t SLOT_BITS = 6;
+        static constexpr uint32_t SLOTS = 1u << SLOT_BITS;
+        static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+        static constexpr uint32_t LEVELS = 5;//2^30 ticks, with 1ms ticks about 12 days, longer timers are cascaded again
+        static constexpr uint32_t NIL = UINT32_MAX;
+
+        struct Node
+        {
+            uint64_t    expiry = 0;
+            uint64_t    period = 0;
+            Job         job;
+            uint32_t    generation = 0;
+            uint32_t    prev = NIL;
+            uint32_t    next = NIL;
+            uint32_t    bucket = NIL;
+            bool        active = false;
+        };
+
+        static uint32_t slotOf(uint64_t tick, uint32_t level) { return static_cast<uint32_t>((tick >> (level * SLOT_BITS)) & SLOT_MASK); }
+
+        void link(uint32_t index)
+        {
+            Node& node = nodes[index];
+            const uint64_t delta = (node.expiry > current) ? (node.expiry - current) : 0;
+            uint32_t level = 0;
+            while ((level + 1 < LEVELS) && (delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS)))) { ++level; }
+            uint64_t tick = (node.expiry > current) ? node.expiry : current;
+            if (delta >= (uint64_t(1) << (LEVELS * SLOT_BITS)))
+            {   //beyond the range of the wheel, park it in the farthest slot of the top level
+                tick = current + (uint64_t(SLOTS - 1) << ((LEVELS - 1) * SLOT_BITS));
+            }
+            const uint32_t bucket = level * SLOTS + slotOf(tick, level);
+            node.bucket = bucket;
+            node.prev = NIL;
+            node.next = heads[bucket];
+            if (node.next != NIL) { nodes[node.next].prev = index; }
+            heads[bucket] = index;
+            occupied[level] |= (uint64_t(1) << (bucket % SLOTS));
+        }
+
+        void unlink(uint32_t index)
+        {
+            Node& node = nodes[index];
+            if (node.prev != NIL) { nodes[node.prev].next = node.next; }
+            else { heads[node.bucket] = node.next; }
+            if (node.next != NIL) { nodes[node.next].prev = node.prev; }
+            if (heads[node.bucket] == NIL) { occupied[node.bucket / SLOTS] &= ~(uint64_t(1) << (node.bucket % SLOTS)); }
+            node.prev = node.next = node.bucket = NIL;
+        }
+
+        uint32_t detach(uint32_t level, uint32_t slot)
+        {
+            const uint32_t bucket = level * SLOTS + slot;
+            const uint32_t head = heads[bucket];
+            heads[bucket] = NIL;
+            occupied[level] &= ~(uint64_t(1) << slot);
+            return head;
+        }
+
+        void release(uint32_t index)
+        {
+            Node& node = nodes[index];
+            node.job.reset();
+            node.active = false;
+            ++node.generation;
+            free_nodes.push_back(index);
+            --count;
+        }
+
+        uint64_t                            current;
+        size_t                              count;
+        std::vector<Node>                   nodes;
+        std::vector<uint32_t>               free_nodes;
+        uint32_t                            heads[LEVELS * SLOTS];
+        uint64_t                            occupied[LEVELS];
+    };
+
     class Worker
     {
     public:
+        /**
+         * Describes how the working thread waits for new jobs
+         * It polls the queue for 'spin' time, then yields its time slice for 'yield' time, then parks
+         * Zero durations skip the given phase, the default parks immediately
+         */
+        struct WaitPolicy
+        {
+            std::chrono::nanoseconds spin;
+            std::chrono::nanoseconds yield;
+            WaitPolicy(std::chrono::nanoseconds s = std::chrono::nanoseconds(0), std::chrono::nanoseconds y = std::chrono::nanoseconds(0)) : spin(s), yield(y) {}
+        };
+        /**
+         * Counts which phase of the wait found work
+         */
+        struct WaitStats
+        {
+            uint64_t immediate = 0;//work was already there
+            uint64_t spin = 0;
+            uint64_t yield = 0;
+            uint64_t park = 0;
+        };
+        /**
+         * Snapshot of the job statistics
+         * Histogram bucket 0 counts durations below 1us, bucket i counts durations in [2^(i-1), 2^i) us,
+         * the last bucket also counts everything above its lower bound
+         */
+        struct Stats
+        {
+            static constexpr size_t BUCKETS = 24;
+            uint32_t                    queue_depth = 0;//jobs pushed but not started yet
+            uint32_t                    peak_queue_depth = 0;
+            uint64_t                    jobs_executed = 0;//including delayed and periodic jobs
+            double                      jobs_per_second = 0.0;//over the last completed second, zero if idle since
+            std::chrono::nanoseconds    max_latency{ 0 };
+            std::chrono::nanoseconds    max_runtime{ 0 };
+            uint64_t                    latency_histogram[BUCKETS] = {};//enqueue to start, pushed jobs only
+            uint64_t                    runtime_histogram[BUCKETS] = {};
+        };
         /**
          * Pushes the given job to the end of the queue
          * @param job Function to call on the working thread
          */
         void push(const std::function<void()>& job)
         {
+            const auto now = stats_enabled.load(std::memory_order_relaxed) ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+            bool wake;
             {
                 std::lock_guard<std::mutex> guard(jobs_mutex);
-                jobs.emplace(job);
+                jobs.emplace(QueuedJob{ job, now });
                 ++counter;
+                wake = parked;
+                const uint32_t depth = queue_depth.fetch_add(1, std::memory_order_relaxed) + 1;
+                if (depth > peak_queue_depth.load(std::memory_order_relaxed)) { peak_queue_depth.store(depth, std::memory_order_relaxed); }
             }
-            cond_var.notify_one();
+            if (wake) { cond_var.notify_one(); }
+        }
+        typedef TimerWheel::TimerId TimerId;
+        /**
+         * Schedules a job to be called once on the working thread after the given delay
+         * @return An identifier usable with cancel()
+         */
+        TimerId schedule(std::chrono::milliseconds delay, const std::function<void()>& job)
+        {
+            return addTimer(delay, std::chrono::milliseconds(0), job);
+        }
+        /**
+         * Schedules a job to be called repeatedly on the working thread
+         * @param period Time between two calls, also the delay before the first one
+         * @return An identifier usable with cancel()
+         */
+        TimerId schedulePeriodic(std::chrono::milliseconds period, const std::function<void()>& job)
+        {
+            if (period.count() <= 0) { return TimerWheel::INVALID_TIMER; }
+            return addTimer(period, period, job);
+        }
+        /**
+         * Cancels a delayed or periodic job
+         * A job that has already been taken for execution may still run once
+         * @return True is returned if the job was pending, otherwise false
+         */
+        bool cancel(TimerId id)
+        {
+            std::lock_guard<std::mutex> guard(jobs_mutex);
+            return timers.cancel(id);
+        }
+        /**
+         * Sets how the working thread waits for jobs, takes effect from the next wait
+         */
+        void setWaitPolicy(const WaitPolicy& policy)
+        {
+            std::lock_guard<std::mutex> guard(jobs_mutex);
+            wait_policy = policy;
+        }
+        /**
+         * Returns how many waits were resolved by each phase since the worker was created
+         */
+        WaitStats waitStats() const
+        {
+            WaitStats stats;
+            stats.immediate = wait_counters[0].load(std::memory_order_relaxed);
+            stats.spin = wait_counters[1].load(std::memory_order_relaxed);
+            stats.yield = wait_counters[2].load(std::memory_order_relaxed);
+            stats.park = wait_counters[3].load(std::memory_order_relaxed);
+            return stats;
+        }
+        /**
+         * Enables or disables collecting the job statistics, enabled by default
+         */
+        void setStatsEnabled(bool enabled) { stats_enabled.store(enabled); }
+        /**
+         * Returns a consistent snapshot of the job statistics without stopping the worker
+         * Queue depths are sampled separately from the rest since they are updated by the pushing threads
+         */
+        Stats stats() const
+        {
+            Stats result;
+            uint64_t window_end;
+            uint32_t begin, end;
+            do
+            {
+                begin = stats_seq.load(std::memory_order_acquire);
+                result.jobs_executed = stats_data.jobs_executed.load(std::memory_order_relaxed);
+                result.jobs_per_second = static_cast<double>(stats_data.last_window_jobs.load(std::memory_order_relaxed));
+                window_end = stats_data.last_window_end.load(std::memory_order_relaxed);
+                result.max_latency = std::chrono::nanoseconds(stats_data.max_latency.load(std::memory_order_relaxed));
+                result.max_runtime = std::chrono::nanoseconds(stats_data.max_runtime.load(std::memory_order_relaxed));
+                for (size_t i = 0; i < Stats::BUCKETS; ++i)
+                {
+                    result.latency_histogram[i] = stats_data.latency_histogram[i].load(std::memory_order_relaxed);
+                    result.runtime_histogram[i] = stats_data.runtime_histogram[i].load(std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                end = stats_seq.load(std::memory_order_relaxed);
+            } while ((begin != end) || (begin & 1));
+
+            const auto idle = std::chrono::steady_clock::now().time_since_epoch() - std::chrono::nanoseconds(window_end);
+            if (idle > 2 * STATS_WINDOW) { result.jobs_per_second = 0.0; }
+            result.queue_depth = queue_depth.load(std::memory_order_relaxed);
+            result.peak_queue_depth = peak_queue_depth.load(std::memory_order_relaxed);
+            return result;
         }
         /**
          * Starts the worker thread if it is not started yet
@@ -116,20 +703,29 @@ namespace threading
                         {
                             start_sync.wake();
                         }
-                        std::queue<std::function<void()>> jobs_cpy;
+                        std::queue<QueuedJob> jobs_cpy;
+                        std::vector<TimerWheel::Job> expired;
                         while (!stop_request.load())
                         {
                             std::unique_lock<std::mutex> lock(jobs_mutex);
-                            cond_var.wait(lock, [this]() -> bool { return ((counter.load() > 0) || stop_request.load()); });
+                            waitForWork(lock);
+                            timers_changed.store(false);
                             jobs_cpy.swap(jobs);
                             counter.store(0);
+                            timers.advance(currentTick(), expired);
                             lock.unlock();
                             while (!jobs_cpy.empty()) 
                             {
                                 auto& job = jobs_cpy.front();
-                                if (job) { job(); }
+                                queue_depth.fetch_sub(1, std::memory_order_relaxed);
+                                run(job.job, job.enqueued);
                                 jobs_cpy.pop();
                             }
+                            for (auto& job : expired)
+                            {
+                                if (job) { run(*job, std::chrono::steady_clock::time_point()); }
+                            }
+                            expired.clear();
                         }
 
                     }));
@@ -138,6 +734,7 @@ namespace threading
                     {
                         start_sync.wait();
                     }
+                    return true;
                 }
             }
             return false;
@@ -151,12 +748,18 @@ namespace threading
             std::unique_lock<std::mutex> guard(thread_mutex);
             if (thread) 
             {
-                stop_request.store(true);
+                {
+                    std::lock_guard<std::mutex> jobs_guard(jobs_mutex);
+                    stop_request.store(true);
+                }
                 cond_var.notify_one();
                 if (thread->joinable()) { thread->join(); }
                 thread.reset();
+                std::lock_guard<std::mutex> jobs_guard(jobs_mutex);
                 counter.store(0);
                 while (!jobs.empty()) { jobs.pop(); }
+                queue_depth.store(0);
+                timers.clear();
                 stop_request.store(false);
             }
         }
@@ -169,19 +772,406 @@ namespace threading
             return thread;
         }
 
-        Worker() : thread(nullptr), thread_mutex(), cond_var(), counter(0), stop_request(false), jobs(), jobs_mutex() {}
+        Worker() : thread(nullptr), thread_mutex(), cond_var(), counter(0), stop_request(false), jobs(), jobs_mutex()
+            , timers(), timers_changed(false), epoch(std::chrono::steady_clock::now()), parked(false), wait_policy(), wait_counters()
+            , stats_enabled(true), queue_depth(0), peak_queue_depth(0), stats_seq(0), stats_data(), window_start(epoch), window_jobs(0) {}
         ~Worker() { stop(); }
     private:
+        struct QueuedJob
+        {
+            std::function<void()>                   job;
+            std::chrono::steady_clock::time_point   enqueued;//default constructed if statistics were disabled
+        };
+
+        struct StatsData
+        {
+            std::atomic<uint64_t>   jobs_executed{ 0 };
+            std::atomic<uint64_t>   last_window_jobs{ 0 };
+            std::atomic<uint64_t>   last_window_end{ 0 };
+            std::atomic<uint64_t>   max_latency{ 0 };
+            std::atomic<uint64_t>   max_runtime{ 0 };
+            std::atomic<uint64_t>   latency_histogram[Stats::BUCKETS] = {};
+            std::atomic<uint64_t>   runtime_histogram[Stats::BUCKETS] = {};
+        };
+
+        static constexpr std::chrono::seconds STATS_WINDOW{ 1 };
+
+        static size_t bucketOf(std::chrono::nanoseconds duration)
+        {
+            const uint64_t us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+            const size_t bucket = static_cast<size_t>(detail::bit_width(us));
+            return (bucket < Stats::BUCKETS) ? bucket : (Stats::BUCKETS - 1);
+        }
+
+        static void bump(std::atomic<uint64_t>& value, uint64_t amount = 1)
+        {   //single writer, no read-modify-write needed
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+        /**
+         * Runs a job on the working thread and records its statistics as a seqlock writer
+         * @param enqueued Time of push(), default constructed if there is no latency to record
+         */
+        void run(const std::function<void()>& job, std::chrono::steady_clock::time_point enqueued)
+        {
+            if (!stats_enabled.load(std::memory_order_relaxed))
+            {
+                if (job) { job(); }
+                return;
+            }
+            const auto start = std::chrono::steady_clock::now();
+            if (job) { job(); }
+            const auto finish = std::chrono::steady_clock::now();
+
+            const uint32_t seq = stats_seq.load(std::memory_order_relaxed);
+            stats_seq.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            if (enqueued != std::chrono::steady_clock::time_point())
+            {
+                const auto latency = start - enqueued;
+                bump(stats_data.latency_histogram[bucketOf(latency)]);
+                if (uint64_t(latency.count()) > stats_data.max_latency.load(std::memory_order_relaxed)) { stats_data.max_latency.store(latency.count(), std::memory_order_relaxed); }
+            }
+            const auto runtime = finish - start;
+            bump(stats_data.runtime_histogram[bucketOf(runtime)]);
+            if (uint64_t(runtime.count()) > stats_data.max_runtime.load(std::memory_order_relaxed)) { stats_data.max_runtime.store(runtime.count(), std::memory_order_relaxed); }
+            bump(stats_data.jobs_executed);
+            ++window_jobs;
+            if (finish - window_start >= STATS_WINDOW)
+            {
+                const double seconds = std::chrono::duration<double>(finish - window_start).count();
+                stats_data.last_window_jobs.store(static_cast<uint64_t>(window_jobs / seconds), std::memory_order_relaxed);
+                stats_data.last_window_end.store(static_cast<uint64_t>(std::chrono::nanoseconds(finish.time_since_epoch()).count()), std::memory_order_relaxed);
+                window_start = finish;
+                window_jobs = 0;
+            }
+            stats_seq.store(seq + 2, std::memory_order_release);
+        }
+
+        /**
+         * Waits on the working thread until there is a job, a timer change, a due timer or a stop request
+         * The lock MUST be held on entry and is held on return
+         */
+        void waitForWork(std::unique_lock<std::mutex>& lock)
+        {
+            const uint64_t next_tick = timers.nextTick();
+            auto ready = [this]() -> bool { return ((counter.load() > 0) || stop_request.load() || timers_changed.load()); };
+            auto due = [this, next_tick]() -> bool { return (next_tick != TimerWheel::NO_TICK) && (currentTick() >= next_tick); };
+            if (ready() || due())
+            {
+                wait_counters[0].fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            const WaitPolicy policy = wait_policy;
+            if ((policy.spin.count() > 0) || (policy.yield.count() > 0))
+            {
+                lock.unlock();
+                auto relaxed_ready = [this]() -> bool 
+                { 
+                    return ((counter.load(std::memory_order_relaxed) > 0) || stop_request.load(std::memory_order_relaxed) || timers_changed.load(std::memory_order_relaxed));
+                };
+                const auto spin_end = std::chrono::steady_clock::now() + policy.spin;
+                const auto yield_end = spin_end + policy.yield;
+                size_t phase = 0;
+                while (phase == 0)
+                {
+                    for (uint32_t i = 0; (i < 64) && !relaxed_ready(); ++i) { cpu_relax(); }
+                    if (relaxed_ready() || due()) { phase = 1; }
+                    else if (std::chrono::steady_clock::now() >= spin_end) { break; }
+                }
+                while (phase == 0)
+                {
+                    std::this_thread::yield();
+                    if (relaxed_ready() || due()) { phase = 2; }
+                    else if (std::chrono::steady_clock::now() >= yield_end) { break; }
+                }
+                lock.lock();
+                if (phase != 0)
+                {
+                    wait_counters[phase].fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+            parked = true;
+            if (next_tick == TimerWheel::NO_TICK) { cond_var.wait(lock, ready); }
+            else { cond_var.wait_until(lock, epoch + std::chrono::milliseconds(next_tick), ready); }
+            parked = false;
+            wait_counters[3].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        uint64_t currentTick() const
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch).count());
+        }
+
+        TimerId addTimer(std::chrono::milliseconds delay, std::chrono::milliseconds period, const std::function<void()>& job)
+        {
+            TimerId id;
+            bool wake;
+            {
+                std::lock_guard<std::mutex> guard(jobs_mutex);
+                //one extra tick rounds the partial current tick up so a job never runs before its delay elapsed
+                const uint64_t ticks = (delay.count() > 0) ? static_cast<uint64_t>(delay.count()) : 0;
+                id = timers.insert(currentTick() + ticks + 1, static_cast<uint64_t>(period.count()), std::make_shared<std::function<void()>>(job));
+                timers_changed.store(true);
+                wake = parked;
+            }
+            if (wake) { cond_var.notify_one(); }
+            return id;
+        }
+
         std::shared_ptr<std::thread>        thread;
         mutable std::mutex                  thread_mutex;
         std::condition_variable             cond_var;
         std::atomic_uint32_t                counter;
         std::atomic_bool                    stop_request;
-        std::queue<std::function<void()>>   jobs;
+        std::queue<QueuedJob>               jobs;
         std::mutex                          jobs_mutex;
+        TimerWheel                          timers;
+        std::atomic_bool                    timers_changed;
+        const std::chrono::steady_clock::time_point epoch;
+        bool                                parked;
+        WaitPolicy                          wait_policy;
+        std::atomic<uint64_t>               wait_counters[4];
+        std::atomic_bool                    stats_enabled;
+        std::atomic<uint32_t>               queue_depth;
+        std::atomic<uint32_t>               peak_queue_depth;
+        std::atomic<uint32_t>               stats_seq;
+        StatsData                           stats_data;
+        std::chrono::steady_clock::time_point window_start;//used by the working thread only
+        uint64_t                            window_jobs;//used by the working thread only
         Sync                                start_sync;
     };
 
+    class ThreadPool
+    {
+    public:
+        /**
+         * @param thread_count Number of threads to start, zero means the number of hardware threads
+         */
+        explicit ThreadPool(size_t thread_count = 0) 
+            : thread_count(thread_count ? thread_count : std::max(1u, std::thread::hardware_concurrency()))
+            , threads(), thread_mutex(), cond_var(), stop_request(false), jobs(), jobs_mutex() {}
+        ~ThreadPool() { stop(); }
+        /**
+         * Pushes the given job to the end of the shared queue
+         */
+        void push(const std::function<void()>& job)
+        {
+            {
+                std::lock_guard<std::mutex> guard(jobs_mutex);
+                jobs.emplace(job);
+            }
+            cond_var.notify_one();
+        }
+        /**
+         * Starts the threads if they are not started yet
+         * @return True is returned on success, othewise false if they are already started
+         */
+        bool start()
+        {
+            std::lock_guard<std::mutex> guard(thread_mutex);
+            if (!threads.empty()) { return false; }
+            for (size_t i = 0; i < thread_count; ++i)
+            {
+                threads.emplace_back([this]()
+                {
+                    while (true)
+                    {
+                        std::unique_lock<std::mutex> lock(jobs_mutex);
+                        cond_var.wait(lock, [this]() -> bool { return (!jobs.empty() || stop_request); });
+                        if (stop_request) { break; }
+                        auto job = std::move(jobs.front());
+                        jobs.pop();
+                        lock.unlock();
+                        if (job) { job(); }
+                    }
+                });
+            }
+            return true;
+        }
+        /**
+         * Stops the threads and waits for them to finish, jobs not started yet are dropped
+         */
+        void stop()
+        {
+            std::lock_guard<std::mutex> guard(thread_mutex);
+            if (threads.empty()) { return; }
+            {
+                std::lock_guard<std::mutex> jobs_guard(jobs_mutex);
+                stop_request = true;
+            }
+            cond_var.notify_all();
+            for (auto& thread : threads) 
+            {
+                if (thread.joinable()) { thread.join(); }
+            }
+            threads.clear();
+            std::lock_guard<std::mutex> jobs_guard(jobs_mutex);
+            while (!jobs.empty()) { jobs.pop(); }
+            stop_request = false;
+        }
+        /**
+         * Returns the number of threads of the pool
+         */
+        size_t size() const noexcept { return thread_count; }
+    private:
+        const size_t                        thread_count;
+        std::vector<std::thread>            threads;
+        std::mutex                          thread_mutex;
+        std::condition_variable             cond_var;
+        bool                                stop_request;
+        std::queue<std::function<void()>>   jobs;
+        std::mutex                          jobs_mutex;
+    };
+
+    class Strand
+    {
+    public:
+        /**
+         * Creates a strand on the given pool, copies refer to the same strand
+         * !!! The pool MUST outlive the strand and all of its pending jobs !!!
+         */
+        explicit Strand(ThreadPool& pool) : state(std::make_shared<State>(pool)) {}
+        /**
+         * Pushes the given job to the end of the strand
+         */
+        void push(const std::function<void()>& job)
+        {
+            bool schedule = false;
+            {
+                std::lock_guard<std::mutex> guard(state->mutex);
+                state->jobs.emplace(job);
+                if (!state->running) { state->running = schedule = true; }
+            }
+            if (schedule) { post(state); }
+        }
+        /**
+         * Tells if the strand has no pending or running jobs
+         */
+        bool idle() const
+        {
+            std::lock_guard<std::mutex> guard(state->mutex);
+            return !state->running;
+        }
+        /**
+         * Returns the number of jobs waiting behind the running one
+         */
+        size_t pending() const
+        {
+            std::lock_guard<std::mutex> guard(state->mutex);
+            return state->jobs.size();
+        }
+    private:
+        //jobs are run in batches, after a batch the strand goes to the end of the pool queue to let other strands in
+        static constexpr size_t BATCH = 16;
+
+        struct State
+        {
+            explicit State(ThreadPool& pool) : pool(pool), mutex(), jobs(), running(false) {}
+            ThreadPool&                         pool;
+            std::mutex                          mutex;
+            std::queue<std::function<void()>>   jobs;
+            bool                                running;
+        };
+
+        static void post(const std::shared_ptr<State>& state)
+        {
+            state->pool.push([state]() { drain(state); });
+        }
+
+        static void drain(const std::shared_ptr<State>& state)
+        {
+            for (size_t i = 0; i < BATCH; ++i)
+            {
+                std::function<void()> job;
+                {
+                    std::lock_guard<std::mutex> guard(state->mutex);
+                    if (state->jobs.empty())
+                    {
+                        state->running = false;
+                        return;
+                    }
+                    job = std::move(state->jobs.front());
+                    state->jobs.pop();
+                }
+                if (job) { job(); }
+            }
+            post(state);
+        }
+
+        std::shared_ptr<State>              state;
+    };
+
+    class KeyedStrands
+    {
+    public:
+        /**
+         * !!! The pool MUST outlive this object and all of its pending jobs !!!
+         */
+        explicit KeyedStrands(ThreadPool& pool) : pool(pool), registry(std::make_shared<Registry>()) {}
+        /**
+         * Pushes the given job to the strand of the given key, the strand is created on first use
+         */
+        void push(uint64_t key, const std::function<void()>& job)
+        {   //pushed under the lock, so a concurrent erase() cannot let the job overtake the ones of a replaced strand
+            std::lock_guard<std::mutex> guard(registry->mutex);
+            find(key).push(job);
+        }
+        /**
+         * Returns the strand of the given key, the strand is created on first use
+         * Jobs pushed to the returned copy after erase() may run concurrently with a new strand of the same key
+         */
+        Strand get(uint64_t key)
+        {
+            std::lock_guard<std::mutex> guard(registry->mutex);
+            return find(key);
+        }
+        /**
+         * Forgets the strand of the given key once it has run the jobs pushed so far
+         * Until then push() keeps using the same strand, so jobs of the key never run concurrently,
+         * jobs pushed after erase() keep the strand alive
+         */
+        void erase(uint64_t key)
+        {
+            std::lock_guard<std::mutex> guard(registry->mutex);
+            auto it = registry->strands.find(key);
+            if (it == registry->strands.end()) { return; }
+            if (it->second.idle())
+            {
+                registry->strands.erase(it);
+                return;
+            }
+            //the entry is only removed by the last of these jobs, so while one runs the key still maps to its strand
+            std::weak_ptr<Registry> weak_registry = registry;
+            it->second.push([weak_registry, key]()
+            {
+                auto registry = weak_registry.lock();
+                if (!registry) { return; }
+                std::lock_guard<std::mutex> guard(registry->mutex);
+                auto it = registry->strands.find(key);
+                //this job is the running one, the strand drained unless something was pushed behind it
+                if ((it != registry->strands.end()) && (it->second.pending() == 0)) { registry->strands.erase(it); }
+            });
+        }
+    private:
+        struct Registry
+        {
+            std::mutex                              mutex;
+            std::unordered_map<uint64_t, Strand>    strands;
+        };
+
+        Strand& find(uint64_t key)
+        {
+            auto it = registry->strands.find(key);
+            if (it == registry->strands.end()) { it = registry->strands.emplace(key, Strand(pool)).first; }
+            return it->second;
+        }
+
+        ThreadPool&                             pool;
+        std::shared_ptr<Registry>               registry;//shared with pending erase jobs, which may outlive this object
+    };
+
     /**
      * Starts an std::thread and waits for it to start
      * @return A shared_ptr is returned for the started std::thread
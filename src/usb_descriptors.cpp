@@ -0,0 +1,210 @@
+#include "usb_descriptors.h"
+#include "libusb-1.0/libusb.h"
+
+#include <cstring>
+#include <algorithm>
+
+//SuperSpeedPlus isochronous endpoint companion, follows the SuperSpeed one if its bmAttributes bit 7 is set
+static constexpr uint8_t SSP_ISO_ENDPOINT_COMP_TYPE = 0x31;
+static constexpr int SSP_ISO_ENDPOINT_COMP_SIZE = 8;
+
+static void parseCompanion(const libusb_endpoint_descriptor& native_ep, UsbEndpointDescriptor& endpoint)
+{
+    libusb_ss_endpoint_companion_descriptor* companion = nullptr;
+    //the context is only used for logging
+    if (libusb_get_ss_endpoint_companion_descriptor(nullptr, &native_ep, &companion) != LIBUSB_SUCCESS) { return; }
+    endpoint.max_burst = companion->bMaxBurst;
+    endpoint.bytes_per_interval = companion->wBytesPerInterval;
+    const bool ssp_iso = (endpoint.transferType() == UsbTransferType::Isochronous) && (companion->bmAttributes & 0x80);
+    libusb_free_ss_endpoint_companion_descriptor(companion);
+    if (!ssp_iso || !native_ep.extra) { return; }
+    for (int offset = 0; offset + 2 <= native_ep.extra_length;)
+    {
+        const unsigned char* descriptor = native_ep.extra + offset;
+        if (descriptor[0] < 2) { break; }
+        if ((descriptor[1] == SSP_ISO_ENDPOINT_COMP_TYPE) && (descriptor[0] >= SSP_ISO_ENDPOINT_COMP_SIZE) && (offset + SSP_ISO_ENDPOINT_COMP_SIZE <= native_ep.extra_length))
+        {
+            endpoint.bytes_per_interval = uint32_t(descriptor[4]) | (uint32_t(descriptor[5]) << 8) | (uint32_t(descriptor[6]) << 16) | (uint32_t(descriptor[7]) << 24);
+            break;
+        }
+        offset += descriptor[0];
+    }
+}
+
+std::shared_ptr<const UsbDescriptors> UsbDescriptors::parse(libusb_device* device)
+{
+    libusb_device_descriptor descriptor;
+    memset(&descriptor, 0, sizeof(descriptor));
+    if (!device || (libusb_get_device_descriptor(device, &descriptor) != LIBUSB_SUCCESS)) { return nullptr; }
+
+    std::shared_ptr<UsbDescriptors> result(new UsbDescriptors());
+    auto& dev = result->mDevice;
+    dev.bcd_usb = descriptor.bcdUSB;
+    dev.vendor = descriptor.idVendor;
+    dev.product = descriptor.idProduct;
+    dev.bcd_device = descriptor.bcdDevice;
+    dev.device_class = descriptor.bDeviceClass;
+    dev.device_subclass = descriptor.bDeviceSubClass;
+    dev.device_protocol = descriptor.bDeviceProtocol;
+    dev.max_packet_size0 = descriptor.bMaxPacketSize0;
+    dev.manufacturer_index = descriptor.iManufacturer;
+    dev.product_index = descriptor.iProduct;
+    dev.serial_number_index = descriptor.iSerialNumber;
+    dev.num_configurations = descriptor.bNumConfigurations;
+
+    result->mConfigs.reserve(descriptor.bNumConfigurations);
+    for (uint8_t config_index = 0; config_index < descriptor.bNumConfigurations; ++config_index)
+    {
+        libusb_config_descriptor* native = nullptr;
+        if (libusb_get_config_descriptor(device, config_index, &native) != LIBUSB_SUCCESS) { continue; }
+
+        UsbConfigDescriptor config;
+        config.value = native->bConfigurationValue;
+        config.attributes = native->bmAttributes;
+        config.max_power = native->MaxPower;
+        config.string_index = native->iConfiguration;
+        config.num_interfaces = native->bNumInterfaces;
+        config.first_alt_setting = static_cast<uint16_t>(result->mAltSettings.size());
+        config.first_interface_slot = static_cast<uint16_t>(result->mInterfaceTable.size());
+        config.endpoint_by_address.fill(UsbConfigDescriptor::NONE);
+
+        for (uint8_t i = 0; i < native->bNumInterfaces; ++i)
+        {
+            const auto& interface = native->interface[i];
+            for (int alt = 0; alt < interface.num_altsetting; ++alt)
+            {
+                const auto& native_alt = interface.altsetting[alt];
+                UsbAltSettingDescriptor alt_setting;
+                alt_setting.interface_number = native_alt.bInterfaceNumber;
+                alt_setting.alt_setting = native_alt.bAlternateSetting;
+                alt_setting.interface_class = native_alt.bInterfaceClass;
+                alt_setting.interface_subclass = native_alt.bInterfaceSubClass;
+                alt_setting.interface_protocol = native_alt.bInterfaceProtocol;
+                alt_setting.string_index = native_alt.iInterface;
+                alt_setting.num_endpoints = native_alt.bNumEndpoints;
+                alt_setting.first_endpoint = static_cast<uint16_t>(result->mEndpoints.size());
+
+                const uint16_t alt_index = static_cast<uint16_t>(result->mAltSettings.size());
+                for (uint8_t e = 0; e < native_alt.bNumEndpoints; ++e)
+                {
+                    const auto& native_ep = native_alt.endpoint[e];
+                    UsbEndpointDescriptor endpoint;
+                    endpoint.address = native_ep.bEndpointAddress;
+                    endpoint.attributes = native_ep.bmAttributes;
+                    endpoint.max_packet_size = native_ep.wMaxPacketSize;
+                    endpoint.interval = native_ep.bInterval;
+                    endpoint.alt_setting_index = alt_index;
+                    parseCompanion(native_ep, endpoint);
+
+                    auto& slot = config.endpoint_by_address[endpointSlot(endpoint.address)];
+                    if ((slot == UsbConfigDescriptor::NONE) || (result->mAltSettings[result->mEndpoints[slot].alt_setting_index].alt_setting > alt_setting.alt_setting))
+                    {
+                        slot = static_cast<uint16_t>(result->mEndpoints.size());
+                    }
+                    result->mEndpoints.emplace_back(endpoint);
+                }
+                result->mAltSettings.emplace_back(alt_setting);
+            }
+        }
+        config.num_alt_settings = static_cast<uint16_t>(result->mAltSettings.size() - config.first_alt_setting);
+        libusb_free_config_descriptor(native);
+
+        //libusb lists interfaces in descriptor order, the table makes them addressable by number
+        auto begin = result->mAltSettings.begin() + config.first_alt_setting;
+        std::stable_sort(begin, result->mAltSettings.end(), [](const UsbAltSettingDescriptor& a, const UsbAltSettingDescriptor& b)
+        {
+            return (a.interface_number != b.interface_number) ? (a.interface_number < b.interface_number) : (a.alt_setting < b.alt_setting);
+        });
+        for (uint16_t i = config.first_alt_setting; i < result->mAltSettings.size(); ++i)
+        {
+            const auto& alt_setting = result->mAltSettings[i];
+            for (uint16_t e = 0; e < alt_setting.num_endpoints; ++e) { result->mEndpoints[alt_setting.first_endpoint + e].alt_setting_index = i; }
+            const size_t slot = config.first_interface_slot + size_t(alt_setting.interface_number);
+            if (result->mInterfaceTable.size() <= slot) { result->mInterfaceTable.resize(slot + 1, UsbConfigDescriptor::NONE); }
+            if (result->mInterfaceTable[slot] == UsbConfigDescriptor::NONE) { result->mInterfaceTable[slot] = i; }
+        }
+        config.num_interface_slots = static_cast<uint16_t>(result->mInterfaceTable.size() - config.first_interface_slot);
+        result->mConfigs.emplace_back(config);
+    }
+    result->mConfigs.shrink_to_fit();
+    result->mAltSettings.shrink_to_fit();
+    result->mEndpoints.shrink_to_fit();
+    result->mInterfaceTable.shrink_to_fit();
+    return result;
+}
+
+const UsbConfigDescriptor* UsbDescriptors::config(uint8_t configuration_value) const noexcept
+{
+    //devices have a single or a handful of configurations
+    for (const auto& config : mConfigs)
+    {
+        if (config.value == configuration_value) { return &config; }
+    }
+    return nullptr;
+}
+
+const UsbAltSettingDescriptor* UsbDescriptors::altSetting(const UsbConfigDescriptor& config, uint8_t interface_number, uint8_t alt_setting) const noexcept
+{
+    if (interface_number >= config.num_interface_slots) { return nullptr; }
+    const uint16_t first = mInterfaceTable[config.first_interface_slot + interface_number];
+    if (first == UsbConfigDescriptor::NONE) { return nullptr; }
+    //alternate settings are numbered from zero without gaps in conforming devices
+    const size_t index = size_t(first) + alt_setting;
+    const size_t end = size_t(config.first_alt_setting) + config.num_alt_settings;
+    if ((index < end) && (mAltSettings[index].interface_number == interface_number) && (mAltSettings[index].alt_setting == alt_setting))
+    {
+        return &mAltSettings[index];
+    }
+    for (size_t i = first; (i < end) && (mAltSettings[i].interface_number == interface_number); ++i)
+    {
+        if (mAltSettings[i].alt_setting == alt_setting) { return &mAltSettings[i]; }
+    }
+    return nullptr;
+}
+
+const UsbEndpointDescriptor* UsbDescriptors::endpoint(const UsbConfigDescriptor& config, uint8_t address) const noexcept
+{
+    const uint16_t index = config.endpoint_by_address[endpointSlot(address)];
+    return (index == UsbConfigDescriptor::NONE) ? nullptr : &mEndpoints[index];
+}
+
+const UsbEndpointDescriptor* UsbDescriptors::endpoint(const UsbAltSettingDescriptor& alt_setting, uint8_t address) const noexcept
+{
+    for (uint16_t i = 0; i < alt_setting.num_endpoints; ++i)
+    {
+        const auto& endpoint = mEndpoints[alt_setting.first_endpoint + i];
+        if (endpoint.address == address) { return &endpoint; }
+    }
+    return nullptr;
+}
+
+uint64_t UsbDescriptors::hash() const noexcept
+{
+    uint64_t result = 14695981039346656037ull;
+    auto add = [&result](uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+        {
+            result ^= (value >> (i * 8)) & 0xFF;
+            result *= 1099511628211ull;
+        }
+    };
+    add(mDevice.bcd_usb, 2); add(mDevice.vendor, 2); add(mDevice.product, 2); add(mDevice.bcd_device, 2);
+    add(mDevice.device_class, 1); add(mDevice.device_subclass, 1); add(mDevice.device_protocol, 1);
+    add(mDevice.max_packet_size0, 1); add(mDevice.manufacturer_index, 1); add(mDevice.product_index, 1);
+    add(mDevice.serial_number_index, 1); add(mDevice.num_configurations, 1);
+    for (const auto& config : mConfigs)
+    {
+        add(config.value, 1); add(config.attributes, 1); add(config.max_power, 1); add(config.num_interfaces, 1);
+    }
+    for (const auto& alt : mAltSettings)
+    {
+        add(alt.interface_number, 1); add(alt.alt_setting, 1); add(alt.interface_class, 1); add(alt.interface_subclass, 1);
+        add(alt.interface_protocol, 1); add(alt.num_endpoints, 1);
+    }
+    for (const auto& endpoint : mEndpoints)
+    {
+        add(endpoint.address, 1); add(endpoint.attributes, 1); add(endpoint.max_packet_size, 2); add(endpoint.interval, 1);
+    }
+    return result;
+}
@@ -0,0 +1,180 @@
+#ifndef _LIB_USB_DESCRIPTORS_H_
+#define _LIB_USB_DESCRIPTORS_H_
+
+#include <stdint.h>
+#include <array>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+//predeclarations
+struct libusb_device;
+
+/*******************************************************************************************************************
+    BRIEF DESCRIPTION OF THE CONTENTS OF THIS HEADER
+
+    classes:
+        UsbDescriptors:
+            description:
+                Read-only copy of the device, configuration, interface, alternate setting and endpoint descriptors
+                of a device. Parsed once, stored in flat contiguous arrays that refer to each other by index,
+                so lookups need no allocation and no pointer chasing through libusb structures.
+            functions:
+                static std::shared_ptr<const UsbDescriptors> parse(libusb_device* device)
+                const UsbConfigDescriptor* config(uint8_t configuration_value) const
+                const UsbAltSettingDescriptor* altSetting(const UsbConfigDescriptor& config, uint8_t interface_number, uint8_t alt_setting) const
+                const UsbEndpointDescriptor* endpoint(const UsbConfigDescriptor& config, uint8_t address) const
+                uint64_t hash() const
+
+********************************************************************************************************************/
+
+struct UsbDeviceDescriptor
+{
+    uint16_t bcd_usb = 0;
+    uint16_t vendor = 0;
+    uint16_t product = 0;
+    uint16_t bcd_device = 0;
+    uint8_t  device_class = 0;
+    uint8_t  device_subclass = 0;
+    uint8_t  device_protocol = 0;
+    uint8_t  max_packet_size0 = 0;
+    uint8_t  manufacturer_index = 0;//string descriptor indices, zero if not present
+    uint8_t  product_index = 0;
+    uint8_t  serial_number_index = 0;
+    uint8_t  num_configurations = 0;
+};
+
+enum class UsbEndpointDirection : uint8_t
+{
+    Out = 0x00,//host to device
+    In = 0x80//device to host
+};
+
+enum class UsbTransferType : uint8_t
+{
+    Control = 0,
+    Isochronous = 1,
+    Bulk = 2,
+    Interrupt = 3
+};
+
+struct UsbEndpointDescriptor
+{
+    uint8_t  address = 0;//bEndpointAddress, bit 7 is the direction
+    uint8_t  attributes = 0;//bmAttributes, bits 0-1 are the transfer type
+    uint16_t max_packet_size = 0;//raw wMaxPacketSize
+    uint8_t  interval = 0;//raw bInterval
+    uint16_t alt_setting_index = 0;//index of the owning alternate setting in altSettings()
+    uint8_t  max_burst = 0;//bMaxBurst of the SuperSpeed endpoint companion, packets per burst minus one
+    uint32_t bytes_per_interval = 0;//wBytesPerInterval of the SuperSpeed endpoint companion, or dwBytesPerInterval
+                                    //of the SuperSpeedPlus isochronous one, zero for endpoints without companion
+
+    UsbEndpointDirection direction() const noexcept { return static_cast<UsbEndpointDirection>(address & 0x80); }
+    UsbTransferType transferType() const noexcept { return static_cast<UsbTransferType>(attributes & 0x03); }
+    /**
+     * Returns the size of one packet, bits 0-10 of wMaxPacketSize
+     */
+    uint16_t packetSize() const noexcept { return max_packet_size & 0x07FF; }
+    /**
+     * Returns the number of packets per (micro)frame, 1 to 3 for high-speed isochronous and interrupt endpoints
+     * encoded in bits 11-12 of wMaxPacketSize, always 1 otherwise
+     */
+    uint8_t mult() const noexcept 
+    { 
+        const auto type = transferType();
+        if ((type != UsbTransferType::Isochronous) && (type != UsbTransferType::Interrupt)) { return 1; }
+        return static_cast<uint8_t>(std::min(((max_packet_size >> 11) & 0x03) + 1, 3));
+    }
+    /**
+     * Returns the bytes a periodic endpoint moves per service interval: bytes_per_interval for SuperSpeed endpoints,
+     * whose bursts and Mult are only described by the companion, packetSize() * mult() otherwise
+     */
+    uint32_t intervalSize() const noexcept
+    {
+        const auto type = transferType();
+        const bool periodic = (type == UsbTransferType::Isochronous) || (type == UsbTransferType::Interrupt);
+        return (periodic && (bytes_per_interval > 0)) ? bytes_per_interval : uint32_t(packetSize()) * mult();
+    }
+};
+
+struct UsbAltSettingDescriptor
+{
+    uint8_t  interface_number = 0;
+    uint8_t  alt_setting = 0;
+    uint8_t  interface_class = 0;
+    uint8_t  interface_subclass = 0;
+    uint8_t  interface_protocol = 0;
+    uint8_t  string_index = 0;
+    uint8_t  num_endpoints = 0;
+    uint16_t first_endpoint = 0;//index into endpoints()
+};
+
+struct UsbConfigDescriptor
+{
+    static constexpr uint16_t NONE = UINT16_MAX;
+    uint8_t  value = 0;//bConfigurationValue
+    uint8_t  attributes = 0;
+    uint8_t  max_power = 0;//raw MaxPower
+    uint8_t  string_index = 0;
+    uint8_t  num_interfaces = 0;
+    uint16_t first_alt_setting = 0;//index into altSettings(), ordered by interface number then alternate setting
+    uint16_t num_alt_settings = 0;
+    uint16_t first_interface_slot = 0;//index into the interface table, see UsbDescriptors::altSetting()
+    uint16_t num_interface_slots = 0;
+    /**
+     * Endpoint index by address, slots 0-15 are OUT endpoints, 16-31 are IN endpoints
+     * Refers to the lowest alternate setting that declares the endpoint, NONE if there is no such endpoint
+     */
+    std::array<uint16_t, 32> endpoint_by_address;
+};
+
+class UsbDescriptors
+{
+public:
+    /**
+     * Reads and flattens every descriptor of the device, configurations that cannot be read are skipped
+     * @return A shared read-only object is returned on success, otherwise nullptr
+     */
+    static std::shared_ptr<const UsbDescriptors> parse(libusb_device* device);
+
+    const UsbDeviceDescriptor& device() const noexcept { return mDevice; }
+    const std::vector<UsbConfigDescriptor>& configs() const noexcept { return mConfigs; }
+    const std::vector<UsbAltSettingDescriptor>& altSettings() const noexcept { return mAltSettings; }
+    const std::vector<UsbEndpointDescriptor>& endpoints() const noexcept { return mEndpoints; }
+    /**
+     * Returns the configuration with the given bConfigurationValue, or nullptr
+     */
+    const UsbConfigDescriptor* config(uint8_t configuration_value) const noexcept;
+    /**
+     * Returns the given alternate setting of the given interface in O(1), or nullptr
+     */
+    const UsbAltSettingDescriptor* altSetting(const UsbConfigDescriptor& config, uint8_t interface_number, uint8_t alt_setting) const noexcept;
+    /**
+     * Returns the endpoint with the given address in O(1), or nullptr
+     * If several alternate settings declare the address, the lowest alternate setting is returned
+     */
+    const UsbEndpointDescriptor* endpoint(const UsbConfigDescriptor& config, uint8_t address) const noexcept;
+    /**
+     * Returns the endpoint with the given address within the given alternate setting, or nullptr
+     */
+    const UsbEndpointDescriptor* endpoint(const UsbAltSettingDescriptor& alt_setting, uint8_t address) const noexcept;
+    /**
+     * Returns a 64-bit FNV-1a hash of every parsed field, usable to tell if a device is still the same model and revision
+     */
+    uint64_t hash() const noexcept;
+    /**
+     * Returns the slot of the given address in UsbConfigDescriptor::endpoint_by_address
+     */
+    static size_t endpointSlot(uint8_t address) noexcept { return (address & 0x0F) | ((address & 0x80) ? 0x10 : 0x00); }
+private:
+    UsbDescriptors() = default;
+
+    UsbDeviceDescriptor                     mDevice;
+    std::vector<UsbConfigDescriptor>        mConfigs;
+    std::vector<UsbAltSettingDescriptor>    mAltSettings;
+    std::vector<UsbEndpointDescriptor>      mEndpoints;
+    std::vector<uint16_t>                   mInterfaceTable;//first alternate setting index per interface number
+};
+typedef std::shared_ptr<const UsbDescriptors> UsbDescriptors_csptr_t;
+
+#endif
@@ -2,6 +2,11 @@
 #include "libusb-1.0/libusb.h"
 
 #include <optional>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <utility>
 
 static int LIBUSB_CALL libusbHotPlugCallback(libusb_context* ctx, libusb_device* device, libusb_hotplug_event event, void* user_data)
 {
@@ -25,28 +30,180 @@ static int LIBUSB_CALL libusbHotPlugCallback(libusb_context* ctx, libusb_device*
     return 1;//returning 1 will deregister this callback if user_data was not given
 }
 
-static std::optional<UsbDeviceId> createUsbDeviceId(libusb_device* device) 
+static std::optional<libusb_device_descriptor> readDeviceDescriptor(libusb_device* device)
 {
-
     libusb_device_descriptor descriptor;
     memset(&descriptor, 0, sizeof(descriptor));
     if (libusb_get_device_descriptor(device, &descriptor) == LIBUSB_SUCCESS)
     {
-        return UsbDeviceId(descriptor.idVendor, descriptor.idProduct);
+        return descriptor;
+    }
+    return std::nullopt;
+}
+
+static bool hasInterfaceClass(libusb_device* device, const std::vector<uint8_t>& classes)
+{
+    bool result = false;
+    libusb_config_descriptor* config = nullptr;
+    if (libusb_get_active_config_descriptor(device, &config) == LIBUSB_SUCCESS)
+    {
+        for (uint8_t i = 0; (i < config->bNumInterfaces) && !result; ++i)
+        {
+            const auto& interface = config->interface[i];
+            for (int alt = 0; (alt < interface.num_altsetting) && !result; ++alt)
+            {
+                const uint8_t interface_class = interface.altsetting[alt].bInterfaceClass;
+                result = (std::find(classes.begin(), classes.end(), interface_class) != classes.end());
+            }
+        }
+        libusb_free_config_descriptor(config);
+    }
+    return result;
+}
+
+static UsbSpeed toUsbSpeed(int speed)
+{
+    switch (speed)
+    {
+    case LIBUSB_SPEED_LOW: return UsbSpeed::Low;
+    case LIBUSB_SPEED_FULL: return UsbSpeed::Full;
+    case LIBUSB_SPEED_HIGH: return UsbSpeed::High;
+    case LIBUSB_SPEED_SUPER: return UsbSpeed::Super;
+    case LIBUSB_SPEED_SUPER_PLUS: return UsbSpeed::SuperPlus;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x0100010A)
+    case LIBUSB_SPEED_SUPER_PLUS_X2: return UsbSpeed::SuperPlusX2;
+#else
+    case 6: return UsbSpeed::SuperPlusX2;//LIBUSB_SPEED_SUPER_PLUS_X2, a newer libusb.so may report it
+#endif
+    default: return UsbSpeed::Unknown;
+    }
+}
+
+static std::optional<UsbDevicePath> createUsbDevicePath(libusb_device* device)
+{
+    UsbDevicePath path(libusb_get_bus_number(device));
+    int depth = libusb_get_port_numbers(device, path.ports.data(), static_cast<int>(path.ports.size()));
+    if (depth >= 0)
+    {
+        path.depth = static_cast<uint8_t>(depth);
+        //backends without port information (no sysfs) report every device like a root hub, the address keeps them apart
+        if ((depth == 0) && libusb_get_parent(device)) { path.address = libusb_get_device_address(device); }
+        return path;
     }
     return std::nullopt;
 }
 
+static std::string escapeCacheField(const std::string& value)
+{
+    std::string result;
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '\\': result += "\\\\"; break;
+        case '\t': result += "\\t"; break;
+        case '\n': result += "\\n"; break;
+        default: result += c; break;
+        }
+    }
+    return result;
+}
+
+static std::string unescapeCacheField(const std::string& value)
+{
+    std::string result;
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        if ((value[i] == '\\') && (i + 1 < value.size()))
+        {
+            ++i;
+            result += (value[i] == 't') ? '\t' : ((value[i] == 'n') ? '\n' : value[i]);
+        }
+        else { result += value[i]; }
+    }
+    return result;
+}
+
+//struct UsbDevicePath
+std::string UsbDevicePath::toString() const
+{
+    std::string result = std::to_string(bus);
+    for (uint8_t i = 0; i < depth; ++i)
+    {
+        result += (i == 0) ? '-' : '.';
+        result += std::to_string(ports[i]);
+    }
+    if (address != 0) { result += '@' + std::to_string(address); }
+    return result;
+}
+
+//struct UsbDeviceQuery
+bool UsbDeviceQuery::matches(const UsbDevice& device) const
+{
+    const auto& id = device.id();
+    if ((id.vendor < vendor_min) || (id.vendor > vendor_max)) { return false; }
+    if (product && (id.product != product.value())) { return false; }
+    if (bus && (device.path().bus != bus.value())) { return false; }
+    const auto& descriptors = device.descriptors();
+    if (device_class && (!descriptors || (descriptors->device().device_class != device_class.value()))) { return false; }
+    if (interface_class)
+    {
+        if (!descriptors) { return false; }
+        const auto& alt_settings = descriptors->altSettings();
+        auto same_class = [this](const UsbAltSettingDescriptor& alt) { return alt.interface_class == interface_class.value(); };
+        if (std::find_if(alt_settings.begin(), alt_settings.end(), same_class) == alt_settings.end()) { return false; }
+    }
+    if (!serial_prefix.empty() && (device.serialNumber().compare(0, serial_prefix.size(), serial_prefix) != 0)) { return false; }
+    return !predicate || predicate(device);
+}
+
+//struct UsbEndpoint
+UsbEndpoint::UsbEndpoint(const UsbEndpointDescriptor& descriptor, const UsbAltSettingDescriptor& owner)
+    : address(descriptor.address)
+    , direction(descriptor.direction())
+    , type(descriptor.transferType())
+    , max_packet_size(descriptor.packetSize())
+    , mult(descriptor.mult())
+    , interval_size(((descriptor.transferType() == UsbTransferType::Isochronous) || (descriptor.transferType() == UsbTransferType::Interrupt)) ? descriptor.intervalSize() : 0)
+    , interval(descriptor.interval)
+    , interface_number(owner.interface_number)
+    , alt_setting(owner.alt_setting)
+{
+}
+
+size_t UsbEndpoint::alignedSize(size_t size) const noexcept
+{
+    const size_t packet = packetSize();
+    if (packet == 0) { return size; }
+    if (size == 0)
+    {
+        switch (type)
+        {
+        case UsbTransferType::Bulk: size = DEFAULT_BULK_TRANSFER_SIZE; break;
+        case UsbTransferType::Isochronous: size = packet * DEFAULT_ISO_PACKETS; break;
+        default: size = packet; break;
+        }
+    }
+    return ((size + packet - 1) / packet) * packet;
+}
+
 //class UsbTransfer
-UsbTransfer::UsbTransfer(const UsbDevice_sptr_t& device) 
+UsbTransfer::UsbTransfer(const UsbDevice_sptr_t& device, const UsbEndpoint& endpoint, size_t size) 
     : mUsbDevice(device)
+    , mEndpoint(endpoint)
+    , mBuffer(size)
 {
 
 }
 
 std::shared_ptr<UsbTransfer> UsbTransfer::makeShared(const UsbDevice_sptr_t& device)
 {
-    return std::shared_ptr<UsbTransfer>(new UsbTransfer(device));
+    return std::shared_ptr<UsbTransfer>(new UsbTransfer(device, UsbEndpoint(), 0));
+}
+
+std::shared_ptr<UsbTransfer> UsbTransfer::makeShared(const UsbDevice_sptr_t& device, const UsbEndpoint& endpoint, size_t size)
+{
+    return std::shared_ptr<UsbTransfer>(new UsbTransfer(device, endpoint, endpoint.alignedSize(size)));
 }
 
 UsbTransfer::~UsbTransfer() 
@@ -54,36 +211,151 @@ UsbTransfer::~UsbTransfer()
 
 }
 
+const UsbEndpoint& UsbTransfer::endpoint() const noexcept { return mEndpoint; }
+
+std::vector<uint8_t>& UsbTransfer::buffer() noexcept { return mBuffer; }
+
+const std::vector<uint8_t>& UsbTransfer::buffer() const noexcept { return mBuffer; }
+
 //class UsbDevice
-UsbDevice::UsbDevice(libusb_device* device, const UsbDeviceId& id)
+UsbDevice::UsbDevice(libusb_device* device, const UsbDeviceId& id, const UsbDevicePath& path, const UsbDescriptors_csptr_t& descriptors)
     : mId(id)
+    , mPath(path)
+    , mDescriptors(descriptors ? descriptors : UsbDescriptors::parse(device))
     , mLibUsbDeviceContext(device)
     , mLibUsbDeviceHandle(nullptr)
+    , mPublishedHandle(nullptr)
+    , mHandleUsers(0)
+    , mRetireMutex()
     , mLastLibUsbError(0)
     , mHandleMutex()
-    , mInterfaceNumber(-1)
+    , mConfiguration(-1)
+    , mClaimedInterfaces()
+    , mAutoDetachKernelDriver(false)
+    , mDetachedInterfaces()
     , mIsValid(true)
+    , mStringsMutex()
+    , mStrings()
+    , mStringsFromCache(false)
+    , mStreamsMutex()
+    , mStreams()
+    , mNextStreamId(1)
+    , mBandwidthBudget()
+    , mExecutor()
+    , mStrand()
 {
+    if (device) { libusb_ref_device(device); }
 }
 
-std::shared_ptr<UsbDevice> UsbDevice::makeShared(libusb_device* device, const UsbDeviceId& id)
+std::shared_ptr<UsbDevice> UsbDevice::makeShared(libusb_device* device, const UsbDeviceId& id, const UsbDevicePath& path, const UsbDescriptors_csptr_t& descriptors)
 {
-    return std::shared_ptr<UsbDevice>(new UsbDevice(device, id));
+    return std::shared_ptr<UsbDevice>(new UsbDevice(device, id, path, descriptors));
 }
 
 UsbDevice::~UsbDevice() 
 {
     close();
+    if (mBandwidthBudget)
+    {
+        for (const auto& [stream_id, stream] : mStreams) { mBandwidthBudget->refund(stream.charged, stream.handlers.bytes_per_second); }
+    }
+    if (auto device = mLibUsbDeviceContext.load()) { libusb_unref_device(device); }
 }
 
 const UsbDeviceId& UsbDevice::id() const noexcept { return mId; }
 
-libusb_device* UsbDevice::native() const noexcept { return mLibUsbDeviceContext; }
+const UsbDevicePath& UsbDevice::path() const noexcept { return mPath; }
+
+const UsbDescriptors_csptr_t& UsbDevice::descriptors() const noexcept { return mDescriptors; }
+
+libusb_device* UsbDevice::native() const noexcept { return mLibUsbDeviceContext.load(); }
+
+libusb_device_handle* UsbDevice::native_handle() const noexcept { return mPublishedHandle.load(std::memory_order_acquire); }
+
+UsbDevice::HandleLease UsbDevice::acquireHandle() const noexcept
+{
+    //empty while the object is being destroyed or if it is not owned by a shared_ptr
+    auto self = weak_from_this().lock();
+    if (!self) { return HandleLease(); }
+    //register as user first, so that a HandleRetirement either waits for us or we see it
+    libusb_device_handle* handle = nullptr;
+    if ((mHandleUsers.fetch_add(HANDLE_USER) & HANDLE_RETIRING) || !(handle = mPublishedHandle.load()))
+    {
+        releaseHandle();
+        return HandleLease();
+    }
+    return HandleLease(std::move(self), handle);
+}
+
+void UsbDevice::releaseHandle() const noexcept
+{
+    //only the last user wakes a waiting HandleRetirement, uncontended leases never issue a syscall
+    if (mHandleUsers.fetch_sub(HANDLE_USER) == (HANDLE_USER | HANDLE_RETIRING)) { threading::wake_on_address(mHandleUsers); }
+}
 
-libusb_device_handle* UsbDevice::native_handle() const noexcept 
-{ 
+void UsbDevice::adoptHandle(libusb_device_handle* handle)
+{
     std::lock_guard guard(mHandleMutex);
-    return mLibUsbDeviceHandle; 
+    mLibUsbDeviceHandle = handle;
+    publishHandle();
+}
+
+void UsbDevice::publishHandle() { mPublishedHandle.store(mLibUsbDeviceHandle); }
+
+//class UsbDevice::HandleRetirement
+UsbDevice::HandleRetirement::HandleRetirement(UsbDevice& device)
+    : mDevice(device)
+    , mGuard(device.mRetireMutex)
+{
+    mDevice.mPublishedHandle.store(nullptr);
+    mDevice.mHandleUsers.fetch_or(HANDLE_RETIRING);
+    uint32_t users;
+    while ((users = mDevice.mHandleUsers.load()) != HANDLE_RETIRING) { threading::wait_on_address(mDevice.mHandleUsers, users); }
+}
+
+UsbDevice::HandleRetirement::~HandleRetirement()
+{   //a handle published meanwhile becomes available to leases from now on
+    mDevice.mHandleUsers.fetch_and(~HANDLE_RETIRING);
+}
+
+//class UsbDevice::HandleLease
+UsbDevice::HandleLease::HandleLease() noexcept
+    : mDevice(nullptr)
+    , mHandle(nullptr)
+{
+}
+
+UsbDevice::HandleLease::HandleLease(std::shared_ptr<const UsbDevice>&& device, libusb_device_handle* handle) noexcept
+    : mDevice(std::move(device))
+    , mHandle(handle)
+{
+}
+
+UsbDevice::HandleLease::HandleLease(HandleLease&& other) noexcept
+    : mDevice(std::move(other.mDevice))
+    , mHandle(std::exchange(other.mHandle, nullptr))
+{
+}
+
+UsbDevice::HandleLease& UsbDevice::HandleLease::operator=(HandleLease&& other) noexcept
+{
+    if (this != &other)
+    {
+        reset();
+        mDevice = std::move(other.mDevice);
+        mHandle = std::exchange(other.mHandle, nullptr);
+    }
+    return *this;
+}
+
+UsbDevice::HandleLease::~HandleLease() { reset(); }
+
+void UsbDevice::HandleLease::reset() noexcept
+{
+    //released before the reference is dropped, the device may be destroyed with it
+    if (mDevice) { mDevice->releaseHandle(); }
+    mDevice.reset();
+    mHandle = nullptr;
 }
 
 int32_t UsbDevice::lastLibUsbError() const noexcept { return mLastLibUsbError.load();  }
@@ -91,239 +363,1471 @@ int32_t UsbDevice::lastLibUsbError() const noexcept { return mLastLibUsbError.lo
 bool UsbDevice::open(int32_t config_number, int32_t interface_number)
 {
     std::lock_guard guard(mHandleMutex);
-    if (mLibUsbDeviceContext && (mLibUsbDeviceHandle == nullptr))
-    {
-        mLastLibUsbError.store(libusb_open(mLibUsbDeviceContext, &mLibUsbDeviceHandle));
-        if (mLastLibUsbError.load() != LIBUSB_SUCCESS) { mLibUsbDeviceHandle = nullptr; }
-    }
+    if (!openHandle()) { return false; }
 
+    bool result = true;
     if ((config_number >= 0) && (interface_number >= 0))
     {
-        if (mLibUsbDeviceHandle)
+        releaseInterfaces();
+        int res = libusb_set_configuration(mLibUsbDeviceHandle, config_number);
+        if (res == LIBUSB_SUCCESS) 
+        {
+            mConfiguration = config_number;
+            result = claim(interface_number);
+        }
+        else 
         {
-            if (mInterfaceNumber >= 0)
-            {
-                libusb_release_interface(mLibUsbDeviceHandle, mInterfaceNumber);//retval is irrelevant
-            }
-            
-            int res = libusb_set_configuration(mLibUsbDeviceHandle, config_number);
-            if (res == LIBUSB_SUCCESS) 
-            {
-                res = libusb_claim_interface(mLibUsbDeviceHandle, interface_number);
-                if (res == LIBUSB_SUCCESS) { mInterfaceNumber = interface_number; }
-            }
             mLastLibUsbError.store(res);
+            result = false;
         }
     }
-
-    return false;
+    //a newly opened handle becomes visible to leases only once it is configured
+    publishHandle();
+    return result;
 }
 
-void UsbDevice::close()
+std::future<bool> UsbDevice::openAsync(int32_t config_number, int32_t interface_number, const std::function<void(bool)>& callback)
 {
-    std::lock_guard guard(mHandleMutex);
-    if (mLibUsbDeviceHandle)
+    auto promise = std::make_shared<std::promise<bool>>();
+    auto future = promise->get_future();
+    auto self = shared_from_this();
+    auto job = [self, config_number, interface_number, callback, promise]()
     {
-        if (mInterfaceNumber >= 0)
-        {
-            libusb_release_interface(mLibUsbDeviceHandle, mInterfaceNumber);//retval is irrelevant
-            mInterfaceNumber = -1;
+        const bool result = self->open(config_number, interface_number);
+        promise->set_value(result);
+        if (callback) { callback(result); }
+    };
+    if (!mExecutor)
+    {   //not hosted, there is no pool to run on
+        job();
+        return future;
+    }
+    {
+        std::lock_guard<std::mutex> executor_guard(mExecutor->mutex);
+        if (mExecutor->pool)
+        {   //opens of the same device run in order, different devices are opened in parallel
+            if (!mStrand) { mStrand = std::make_unique<threading::Strand>(*mExecutor->pool); }
+            mStrand->push(job);
+            return future;
         }
-        libusb_close(mLibUsbDeviceHandle);
     }
+    //the host is gone, the device must not be used with its libusb context any more
+    mLastLibUsbError.store(LIBUSB_ERROR_NO_DEVICE);
+    promise->set_value(false);
+    if (callback) { callback(false); }
+    return future;
 }
 
-bool UsbDevice::resetPort()
+bool UsbDevice::claimInterface(int32_t interface_number, int32_t alt_setting)
 {
-    std::unique_lock locker(mHandleMutex);
-    if (mLibUsbDeviceHandle)
+    std::lock_guard guard(mHandleMutex);
+    if (!openHandle()) { return false; }
+    const bool result = ((mClaimedInterfaces.find(interface_number) != mClaimedInterfaces.end()) || claim(interface_number))
+        && ((alt_setting < 0) || applyAltSetting(interface_number, alt_setting));
+    publishHandle();
+    return result;
+}
+
+bool UsbDevice::releaseInterface(int32_t interface_number)
+{
+    std::lock_guard guard(mHandleMutex);
+    auto it = mClaimedInterfaces.find(interface_number);
+    if (!mLibUsbDeviceHandle || (it == mClaimedInterfaces.end())) { return false; }
+    int res = libusb_release_interface(mLibUsbDeviceHandle, interface_number);
+    mClaimedInterfaces.erase(it);
+    reattachKernelDriver(interface_number);
+    mLastLibUsbError.store(res);
+    return (res == LIBUSB_SUCCESS);
+}
+
+bool UsbDevice::setAltSetting(int32_t interface_number, int32_t alt_setting)
+{
+    std::lock_guard guard(mHandleMutex);
+    if (!mLibUsbDeviceHandle || (mClaimedInterfaces.find(interface_number) == mClaimedInterfaces.end()))
     {
-        int32_t res = libusb_reset_device(mLibUsbDeviceHandle);
-        if (res != LIBUSB_SUCCESS) 
-        {
-            if (mInterfaceNumber >= 0)
-            {
-                libusb_release_interface(mLibUsbDeviceHandle, mInterfaceNumber);//retval is irrelevant
-                mInterfaceNumber = -1;
-            }
-            libusb_close(mLibUsbDeviceHandle);
-            mIsValid.store(false);
-            return false;
-        }
-        return true;
+        mLastLibUsbError.store(LIBUSB_ERROR_NOT_FOUND);
+        return false;
     }
-    return true;
+    return applyAltSetting(interface_number, alt_setting);
 }
 
-bool UsbDevice::clearHalt(int32_t endpoint_number)
+std::map<int32_t, int32_t> UsbDevice::claimedInterfaces() const
 {
-    std::unique_lock locker(mHandleMutex);
-    if (mLibUsbDeviceHandle)
-    {
-        int32_t res = libusb_clear_halt(mLibUsbDeviceHandle, endpoint_number);
-        if (res != LIBUSB_SUCCESS)
-        {
-            mLastLibUsbError.store(res);
-            return false;
-        }
-        return true;
+    std::lock_guard guard(mHandleMutex);
+    return mClaimedInterfaces;
+}
+
+int32_t UsbDevice::configuration() const
+{
+    std::lock_guard guard(mHandleMutex);
+    return mConfiguration;
+}
+
+bool UsbDevice::openHandle()
+{
+    if (mLibUsbDeviceHandle) { return true; }
+    libusb_device* device = mLibUsbDeviceContext.load();
+    if (!device) { return false; }
+    int32_t res = libusb_open(device, &mLibUsbDeviceHandle);
+    mLastLibUsbError.store(res);
+    if (res != LIBUSB_SUCCESS) 
+    { 
+        mLibUsbDeviceHandle = nullptr; 
+        return false;
     }
     return true;
 }
 
-bool UsbDevice::isValid() const { return mIsValid.load();  }
-
-UsbTransfer_sptr_t UsbDevice::newTransfer()
+bool UsbDevice::applyAltSetting(int32_t interface_number, int32_t alt_setting)
 {
-    return UsbTransfer::makeShared(shared_from_this());
+    int res = libusb_set_interface_alt_setting(mLibUsbDeviceHandle, interface_number, alt_setting);
+    mLastLibUsbError.store(res);
+    if (res != LIBUSB_SUCCESS) { return false; }
+    mClaimedInterfaces[interface_number] = alt_setting;
+    return true;
 }
 
-//class UsbHost
-UsbHost::UsbHost(const std::function<void(const UsbDevice_sptr_t&)>& plugged_in_cb, bool verbose, bool debug)
-    : mLibUsbContext(nullptr)
-    , mLibUsbHotPlugCbHandle(-1)
-    , mLastLibUsbError(0)
-    , mHotPlugMutex()
-    , mDevices()
-    , mWorker()
-    , mPluggedInCallback(plugged_in_cb)
+void UsbDevice::releaseInterfaces()
 {
-    mLastLibUsbError.store(libusb_init(&mLibUsbContext));
-    if (mLastLibUsbError.load() != LIBUSB_SUCCESS)
-    { mLibUsbContext = nullptr; }
-    else if(verbose || debug)
+    for (const auto& [interface_number, alt_setting] : mClaimedInterfaces)
     {
-        auto log_level = debug ? libusb_log_level::LIBUSB_LOG_LEVEL_DEBUG : libusb_log_level::LIBUSB_LOG_LEVEL_WARNING;
-        mLastLibUsbError.store(libusb_set_option(mLibUsbContext, LIBUSB_OPTION_LOG_LEVEL, log_level));
+        libusb_release_interface(mLibUsbDeviceHandle, interface_number);//retval is irrelevant
+        reattachKernelDriver(interface_number);
     }
+    mClaimedInterfaces.clear();
+}
 
-    if (mLibUsbContext && (mLastLibUsbError.load() == LIBUSB_SUCCESS))
+bool UsbDevice::claim(int32_t interface_number)
+{
+    if (mAutoDetachKernelDriver.load() && (libusb_kernel_driver_active(mLibUsbDeviceHandle, interface_number) == 1))
     {
-        if (mPluggedInCallback) { mWorker.start(true); }
-        if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
-        {
-            libusb_hotplug_register_callback(mLibUsbContext
-                , (libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
-                , libusb_hotplug_flag::LIBUSB_HOTPLUG_ENUMERATE
-                , LIBUSB_HOTPLUG_MATCH_ANY /*vendor_id*/
-                , LIBUSB_HOTPLUG_MATCH_ANY /*product_id*/
-                , LIBUSB_HOTPLUG_MATCH_ANY /*dev_class*/
-                , libusbHotPlugCallback
-                , this
-                , &mLibUsbHotPlugCbHandle);
-        }
-        else
+        int res = libusb_detach_kernel_driver(mLibUsbDeviceHandle, interface_number);
+        if (res != LIBUSB_SUCCESS)
         {
-            discoverDevices();
-            mLastLibUsbError.store(LIBUSB_ERROR_NOT_SUPPORTED);
+            mLastLibUsbError.store(res);
+            return false;
         }
+        mDetachedInterfaces.insert(interface_number);
     }
+    int res = libusb_claim_interface(mLibUsbDeviceHandle, interface_number);
+    mLastLibUsbError.store(res);
+    if (res != LIBUSB_SUCCESS)
+    {
+        reattachKernelDriver(interface_number);
+        return false;
+    }
+    mClaimedInterfaces[interface_number] = 0;
+    return true;
 }
 
-UsbHost::~UsbHost()
+void UsbDevice::reattachKernelDriver(int32_t interface_number)
 {
-    if (mLibUsbContext)
+    if (mDetachedInterfaces.erase(interface_number) > 0)
     {
-        libusb_hotplug_deregister_callback(mLibUsbContext, mLibUsbHotPlugCbHandle);
-        mWorker.stop();
-        closeDevices();
-        libusb_exit(mLibUsbContext);
+        libusb_attach_kernel_driver(mLibUsbDeviceHandle, interface_number);//retval is irrelevant, the device may be gone
     }
 }
 
-libusb_context* UsbHost::native() const noexcept { return mLibUsbContext; }
+void UsbDevice::setAutoDetachKernelDriver(bool enable) { mAutoDetachKernelDriver.store(enable); }
 
-int32_t UsbHost::lastLibUsbError() const noexcept
+UsbSpeed UsbDevice::speed() const
 {
-    return mLastLibUsbError.load();
+    auto device = native();
+    return device ? toUsbSpeed(libusb_get_device_speed(device)) : UsbSpeed::Unknown;
 }
 
-UsbDevice_sptr_t UsbHost::getDevice(uint16_t vendor_id, uint16_t product_id) const
+uint32_t UsbDevice::addStream(const UsbStreamHandlers& handlers)
 {
-    std::lock_guard<std::mutex> hotplug_guard(mHotPlugMutex);
-    UsbDeviceId id(vendor_id, product_id);
-    const auto it = mDevices.find(id);
-    if (it != mDevices.cend()) 
+    Stream stream{ handlers, {}, false };
+    if (mBandwidthBudget && (handlers.bytes_per_second > 0) && !mBandwidthBudget->charge(*this, handlers.bytes_per_second, stream.charged))
     {
-        return it->second;
+        mLastLibUsbError.store(LIBUSB_ERROR_BUSY);
+        return 0;
     }
-    return nullptr;
+    std::lock_guard streams_guard(mStreamsMutex);
+    const uint32_t stream_id = mNextStreamId++;
+    mStreams[stream_id] = std::move(stream);
+    return stream_id;
 }
 
-int32_t UsbHost::registerLibUsbDevice(libusb_device* device) 
+void UsbDevice::removeStream(uint32_t stream_id)
 {
-    std::lock_guard<std::mutex> hotplug_guard(mHotPlugMutex);
-    if (auto opt = createUsbDeviceId(device))
+    Stream stream;
     {
-        auto& id = opt.value();
-        auto it = mDevices.find(id);
-        if (it == mDevices.end())
-        {
-            auto device_obj = UsbDevice::makeShared(device, id);
-            mDevices.emplace(id, device_obj);
-            if (mPluggedInCallback) 
-            {
-                auto plugged_in_cb = mPluggedInCallback;
-                mWorker.push([plugged_in_cb, device_obj]() { plugged_in_cb(device_obj); });
-            }
-        }
+        std::lock_guard streams_guard(mStreamsMutex);
+        auto it = mStreams.find(stream_id);
+        if (it == mStreams.end()) { return; }
+        stream = std::move(it->second);
+        mStreams.erase(it);
     }
-    return 0;
+    if (mBandwidthBudget) { mBandwidthBudget->refund(stream.charged, stream.handlers.bytes_per_second); }
 }
 
-int32_t UsbHost::unregisterLibUsbDevice(libusb_device* device)
+size_t UsbDevice::suspendStreams()
 {
-    std::lock_guard<std::mutex> hotplug_guard(mHotPlugMutex);
-    if (auto opt = createUsbDeviceId(device))
+    std::vector<std::function<void()>> handlers;
+    {   //handlers are called without the lock, they may add or remove streams
+        std::lock_guard streams_guard(mStreamsMutex);
+        for (auto& [stream_id, stream] : mStreams)
+        {   //a stream suspended already, e.g. by a reset before the device was lost, is not suspended twice
+            if (std::exchange(stream.suspended, true)) { continue; }
+            handlers.emplace_back(stream.handlers.suspend);
+        }
+    }
+    for (const auto& suspend : handlers)
     {
-        mDevices.erase(opt.value());
+        if (suspend) { suspend(); }
     }
-    return 0;
+    return handlers.size();
 }
 
-std::vector<UsbDeviceId> UsbHost::discoverDevicesIds()
+size_t UsbDevice::resumeStreams()
 {
-    std::vector<UsbDeviceId> result;
-    if (mLibUsbContext) 
+    std::vector<std::function<void()>> handlers;
     {
-        libusb_device** device_list = nullptr;
-        auto device_number = libusb_get_device_list(mLibUsbContext, &device_list);
-        if (device_number > 0) 
+        std::lock_guard streams_guard(mStreamsMutex);
+        for (auto& [stream_id, stream] : mStreams)
         {
-            for (int i = 0; i < device_number; ++i)
-            {
-                if (auto opt = createUsbDeviceId(device_list[i]))
-                {
-                    result.emplace_back(opt.value());
-                }
-            }
+            if (!std::exchange(stream.suspended, false)) { continue; }
+            handlers.emplace_back(stream.handlers.resume);
         }
-        libusb_free_device_list(device_list, 0);
     }
-    return result;
+    for (const auto& resume : handlers)
+    {
+        if (resume) { resume(); }
+    }
+    return handlers.size();
 }
 
-void UsbHost::discoverDevices()
+bool UsbDevice::rebind(libusb_device* device)
 {
-    if (mLibUsbContext)
+    HandleRetirement retirement(*this);
+    std::lock_guard guard(mHandleMutex);
+    //a device given up by resetPort(UsbResetMode::PreserveState) is closed but keeps its claims
+    const bool was_open = (mLibUsbDeviceHandle != nullptr) || !mClaimedInterfaces.empty();
+    if (mLibUsbDeviceHandle)
+    {   //the old device is gone, its interfaces need no release
+        libusb_close(mLibUsbDeviceHandle);
+        mLibUsbDeviceHandle = nullptr;
+    }
+    mDetachedInterfaces.clear();//the kernel drivers of the new device are detached again by claim()
+    libusb_ref_device(device);
+    if (auto previous = mLibUsbDeviceContext.exchange(device)) { libusb_unref_device(previous); }
+    const auto claimed = std::exchange(mClaimedInterfaces, {});
+    if (was_open)
     {
-        libusb_device** device_list = nullptr;
-        auto device_number = libusb_get_device_list(mLibUsbContext, &device_list);
-        if (device_number > 0)
+        if (!openHandle()) { return false; }
+        bool restored = (mConfiguration < 0);
+        if (!restored)
         {
-            for (int i = 0; i < device_number; ++i)
-            {
-                registerLibUsbDevice(device_list[i]);
-            }
+            int res = libusb_set_configuration(mLibUsbDeviceHandle, mConfiguration);
+            mLastLibUsbError.store(res);
+            restored = (res == LIBUSB_SUCCESS);
+        }
+        for (auto it = claimed.begin(); restored && (it != claimed.end()); ++it)
+        {
+            restored = claim(it->first) && ((it->second == 0) || applyAltSetting(it->first, it->second));
+        }
+        if (!restored)
+        {
+            releaseInterfaces();
+            libusb_close(mLibUsbDeviceHandle);
+            mLibUsbDeviceHandle = nullptr;
+            mConfiguration = -1;
+            return false;
         }
-        libusb_free_device_list(device_list, 0);
+        //leases see the handle only once it is configured as before
+        publishHandle();
     }
+    mIsValid.store(true);
+    return true;
 }
 
-void UsbHost::closeDevices()
+void UsbDevice::close()
 {
-    std::lock_guard<std::mutex> hotplug_guard(mHotPlugMutex);
-    for (auto& [id, device] : mDevices) 
+    HandleRetirement retirement(*this);
+    std::lock_guard guard(mHandleMutex);
+    if (mLibUsbDeviceHandle)
+    {
+        releaseInterfaces();
+        libusb_close(mLibUsbDeviceHandle);
+        mLibUsbDeviceHandle = nullptr;
+        mConfiguration = -1;
+    }
+}
+
+bool UsbDevice::resetPort()
+{
+    return resetPort(UsbResetMode::Plain).success;
+}
+
+UsbResetReport UsbDevice::resetPort(UsbResetMode mode)
+{
+    UsbResetReport report;
+    const bool preserve = (mode == UsbResetMode::PreserveState);
+    auto started = std::chrono::steady_clock::now();
+    auto lap = [&started]()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        return now - std::exchange(started, now);
+    };
+    {   //nothing to reset on a closed device, its streams are left alone
+        std::lock_guard guard(mHandleMutex);
+        if (!mLibUsbDeviceHandle)
+        {
+            report.success = true;
+            return report;
+        }
+    }
+    if (preserve) { report.streams = suspendStreams(); }
+    report.suspend = lap();
+
+    {   //leases are drained before the device is locked, the resumed streams need them again afterwards
+        HandleRetirement retirement(*this);
+        std::lock_guard guard(mHandleMutex);
+        if (!mLibUsbDeviceHandle)
+        {   //closed meanwhile
+            report.success = true;
+        }
+        else
+        {
+            report.error = libusb_reset_device(mLibUsbDeviceHandle);
+            report.reset = lap();
+            report.reenumerated = (report.error == LIBUSB_ERROR_NOT_FOUND);
+            if (report.error == LIBUSB_SUCCESS) 
+            { 
+                report.success = !preserve || restoreState(); 
+                if (!report.success) { report.error = mLastLibUsbError.load(); }
+                report.restore = lap();
+            }
+            if (!report.success)
+            {   //claims are kept for a rebind of the re-enumerated device, otherwise the device is given up
+                if (!(preserve && report.reenumerated)) { releaseInterfaces(); }
+                libusb_close(mLibUsbDeviceHandle);
+                mLibUsbDeviceHandle = nullptr;
+                mLastLibUsbError.store(report.error);
+                mIsValid.store(false);
+                return report;
+            }
+            publishHandle();
+        }
+    }
+
+    if (preserve) { resumeStreams(); }
+    report.resume = lap();
+    return report;
+}
+
+bool UsbDevice::restoreState()
+{
+    const auto claimed = mClaimedInterfaces;
+    int active = -1;
+    int res = libusb_get_configuration(mLibUsbDeviceHandle, &active);
+    if ((res == LIBUSB_SUCCESS) && (mConfiguration >= 0) && (active != mConfiguration))
+    {   //the configuration cannot be changed while interfaces are claimed
+        releaseInterfaces();
+        res = libusb_set_configuration(mLibUsbDeviceHandle, mConfiguration);
+    }
+    if (res != LIBUSB_SUCCESS)
+    {
+        mLastLibUsbError.store(res);
+        return false;
+    }
+    for (const auto& [interface_number, alt_setting] : claimed)
+    {
+        //claiming an interface claimed already by the handle is a no-op, selecting the alternate setting resets the endpoints
+        const bool claimed_now = (mClaimedInterfaces.find(interface_number) != mClaimedInterfaces.end());
+        res = claimed_now ? libusb_claim_interface(mLibUsbDeviceHandle, interface_number) : LIBUSB_SUCCESS;
+        if (res != LIBUSB_SUCCESS)
+        {
+            mLastLibUsbError.store(res);
+            return false;
+        }
+        if ((!claimed_now && !claim(interface_number)) || !applyAltSetting(interface_number, alt_setting)) { return false; }
+    }
+    return true;
+}
+
+bool UsbDevice::clearHalt(int32_t endpoint_number)
+{
+    std::unique_lock locker(mHandleMutex);
+    if (mLibUsbDeviceHandle)
+    {
+        int32_t res = libusb_clear_halt(mLibUsbDeviceHandle, endpoint_number);
+        if (res != LIBUSB_SUCCESS)
+        {
+            mLastLibUsbError.store(res);
+            return false;
+        }
+        return true;
+    }
+    return true;
+}
+
+std::string UsbDevice::manufacturer() const { return cachedString(MANUFACTURER); }
+
+std::string UsbDevice::product() const { return cachedString(PRODUCT); }
+
+std::string UsbDevice::serialNumber() const { return cachedString(SERIAL_NUMBER); }
+
+void UsbDevice::prefetchStrings() const
+{
+    std::lock_guard strings_guard(mStringsMutex);
+    std::vector<StringIndex> missing;
+    for (size_t i = 0; i < STRING_COUNT; ++i)
+    {
+        if (!mStrings[i]) { missing.emplace_back(static_cast<StringIndex>(i)); }
+    }
+    if (!missing.empty()) { fetchStrings(missing); }
+}
+
+std::string UsbDevice::cachedString(StringIndex which) const
+{
+    std::lock_guard strings_guard(mStringsMutex);
+    if (!mStrings[which]) { fetchStrings({ which }); }
+    return mStrings[which].value_or(std::string());
+}
+
+std::optional<std::string> UsbDevice::readString(StringIndex which) const
+{
+    std::lock_guard strings_guard(mStringsMutex);
+    auto previous = std::exchange(mStrings[which], std::nullopt);
+    if (!fetchStrings({ which })) 
+    { 
+        mStrings[which] = previous;
+        return std::nullopt; 
+    }
+    return mStrings[which];
+}
+
+void UsbDevice::verifyCachedStrings() const
+{
+    std::lock_guard strings_guard(mStringsMutex);
+    if (!mStringsFromCache) { return; }
+    const auto cached = std::exchange(mStrings, {});
+    if (fetchStrings({ MANUFACTURER, PRODUCT, SERIAL_NUMBER })) 
+    { 
+        mStringsFromCache = false;
+        return; 
+    }
+    //strings that could not be read keep their cached values, but are not persisted again
+    for (size_t i = 0; i < STRING_COUNT; ++i)
+    {
+        if (!mStrings[i]) { mStrings[i] = cached[i]; }
+    }
+}
+
+bool UsbDevice::fetchStrings(const std::vector<StringIndex>& which) const
+{
+    if (!mDescriptors) { return false; }
+    const auto& descriptor = mDescriptors->device();
+    const uint8_t indices[STRING_COUNT] = { descriptor.manufacturer_index, descriptor.product_index, descriptor.serial_number_index };
+
+    std::vector<StringIndex> to_read;
+    for (auto index : which)
+    {   //a zero index means the device has no such string, that is final
+        if (indices[index] == 0) { mStrings[index] = std::string(); }
+        else { to_read.emplace_back(index); }
+    }
+    if (to_read.empty()) { return true; }
+
+    std::lock_guard handle_guard(mHandleMutex);
+    libusb_device_handle* handle = mLibUsbDeviceHandle;
+    const bool temporary = (handle == nullptr);
+    if (temporary)
+    {
+        int32_t res = libusb_open(mLibUsbDeviceContext.load(), &handle);
+        if (res != LIBUSB_SUCCESS) 
+        { 
+            mLastLibUsbError.store(res);
+            return false; 
+        }
+    }
+    bool result = true;
+    for (auto index : to_read)
+    {
+        unsigned char buffer[256];
+        int res = libusb_get_string_descriptor_ascii(handle, indices[index], buffer, sizeof(buffer));
+        if (res >= 0) { mStrings[index] = std::string(reinterpret_cast<const char*>(buffer), static_cast<size_t>(res)); }
+        else 
+        {   //not cached, a later call may succeed
+            mLastLibUsbError.store(res);
+            result = false;
+        }
+    }
+    if (temporary) { libusb_close(handle); }
+    return result;
+}
+
+bool UsbDevice::isValid() const { return mIsValid.load();  }
+
+UsbTransfer_sptr_t UsbDevice::newTransfer()
+{
+    return UsbTransfer::makeShared(shared_from_this());
+}
+
+UsbTransfer_sptr_t UsbDevice::newTransfer(uint8_t endpoint_address, size_t size)
+{
+    auto ep = endpoint(endpoint_address);
+    if (!ep)
+    {
+        mLastLibUsbError.store(LIBUSB_ERROR_NOT_FOUND);
+        return nullptr;
+    }
+    return UsbTransfer::makeShared(shared_from_this(), ep.value(), size);
+}
+
+std::vector<UsbEndpoint> UsbDevice::endpoints() const
+{
+    std::vector<UsbEndpoint> result;
+    if (!mDescriptors || mDescriptors->configs().empty()) { return result; }
+    std::lock_guard guard(mHandleMutex);
+    if (!mLibUsbDeviceHandle || mClaimedInterfaces.empty()) { return result; }
+    int configuration = mConfiguration;
+    if (configuration < 0)
+    {   //no configuration was selected through this object, interfaces were claimed on the active one
+        int res = libusb_get_configuration(mLibUsbDeviceHandle, &configuration);
+        if (res != LIBUSB_SUCCESS)
+        {
+            mLastLibUsbError = res;
+            return result;
+        }
+    }
+    const UsbConfigDescriptor* config = (configuration > 0) ? mDescriptors->config(static_cast<uint8_t>(configuration)) : nullptr;
+    if (!config) { return result; }
+    for (const auto& [interface_number, alt_setting] : mClaimedInterfaces)
+    {
+        const auto* alt = mDescriptors->altSetting(*config, static_cast<uint8_t>(interface_number), static_cast<uint8_t>(alt_setting));
+        if (!alt) { continue; }
+        for (uint16_t i = 0; i < alt->num_endpoints; ++i) { result.emplace_back(mDescriptors->endpoints()[alt->first_endpoint + i], *alt); }
+    }
+    return result;
+}
+
+std::optional<UsbEndpoint> UsbDevice::endpoint(uint8_t address) const
+{
+    for (const auto& ep : endpoints())
+    {
+        if (ep.address == address) { return ep; }
+    }
+    return std::nullopt;
+}
+
+std::optional<UsbEndpoint> UsbDevice::endpoint(UsbEndpointDirection direction, UsbTransferType type) const
+{
+    for (const auto& ep : endpoints())
+    {
+        if ((ep.direction == direction) && (ep.type == type)) { return ep; }
+    }
+    return std::nullopt;
+}
+
+//class UsbBandwidthBudget
+UsbBandwidthBudget::UsbBandwidthBudget(libusb_context* context, UsbBandwidthPolicy policy, double usable_fraction, const UsbBandwidthCallback& callback)
+    : mMutex()
+    , mContext(context)
+    , mPolicy(policy)
+    , mUsableFraction(std::clamp(usable_fraction, 0.0, 1.0))
+    , mCallback(callback)
+    , mNodes()
+{
+}
+
+uint64_t UsbBandwidthBudget::bytesPerSecond(UsbSpeed speed) noexcept
+{
+    switch (speed)
+    {
+    case UsbSpeed::Low: return 1500000ull / 8;
+    case UsbSpeed::Full: return 12000000ull / 8;
+    case UsbSpeed::High: return 480000000ull / 8;
+    case UsbSpeed::Super: return 5000000000ull / 8;
+    case UsbSpeed::SuperPlus: return 10000000000ull / 8;
+    case UsbSpeed::SuperPlusX2: return 20000000000ull / 8;
+    default: return 0;
+    }
+}
+
+bool UsbBandwidthBudget::charge(const UsbDevice& device, uint64_t bytes_per_second, std::vector<UsbDevicePath>& charged)
+{
+    std::vector<UsbBandwidthUsage> oversubscribed;
+    bool refused = false;
+    {
+        std::lock_guard<std::mutex> guard(mMutex);
+        libusb_device* native = device.native();
+        if (!mContext || !native) { return true; }
+        //parents are only guaranteed to be valid while a device list is held
+        libusb_device** device_list = nullptr;
+        if (libusb_get_device_list(mContext, &device_list) < 0) { return true; }
+        std::vector<UsbBandwidthUsage> links;
+        for (libusb_device* link = native; link; link = libusb_get_parent(link))
+        {
+            UsbBandwidthUsage usage;
+            //the registered path of the device itself, wrapped devices have no port based one
+            if (link == native) { usage.node = device.path(); }
+            else if (auto path = createUsbDevicePath(link)) { usage.node = path.value(); }
+            else { break; }
+            usage.speed = toUsbSpeed(libusb_get_device_speed(link));
+            usage.capacity = static_cast<uint64_t>(bytesPerSecond(usage.speed) * mUsableFraction);
+            links.emplace_back(usage);
+        }
+        libusb_free_device_list(device_list, 1);
+
+        bool exceeded = false;
+        for (const auto& link : links)
+        {
+            const auto it = mNodes.find(link.node);
+            const uint64_t allocated = ((it != mNodes.end()) ? it->second.allocated : 0) + bytes_per_second;
+            //an unknown speed cannot be checked, it is reported so the caller knows the budget is unverified
+            const bool over = (link.capacity > 0) && (allocated > link.capacity);
+            if (over || (link.capacity == 0))
+            { 
+                exceeded = exceeded || over;
+                oversubscribed.emplace_back(link);
+                oversubscribed.back().allocated = allocated;
+            }
+        }
+        refused = exceeded && (mPolicy == UsbBandwidthPolicy::Refuse);
+        if (!refused)
+        {
+            charged.clear();
+            for (const auto& link : links)
+            {
+                auto& node = mNodes.emplace(link.node, link).first->second;
+                node.speed = link.speed;
+                node.capacity = link.capacity;
+                node.allocated += bytes_per_second;
+                charged.emplace_back(link.node);
+            }
+        }
+        if (mPolicy == UsbBandwidthPolicy::Ignore) { oversubscribed.clear(); }
+        if (oversubscribed.empty() || !mCallback) { return !refused; }
+    }
+    mCallback(device, oversubscribed);
+    return !refused;
+}
+
+void UsbBandwidthBudget::refund(const std::vector<UsbDevicePath>& charged, uint64_t bytes_per_second)
+{
+    std::lock_guard<std::mutex> guard(mMutex);
+    for (const auto& path : charged)
+    {
+        auto it = mNodes.find(path);
+        if (it == mNodes.end()) { continue; }
+        it->second.allocated -= std::min(it->second.allocated, bytes_per_second);
+        if (it->second.allocated == 0) { mNodes.erase(it); }
+    }
+}
+
+std::vector<UsbBandwidthUsage> UsbBandwidthBudget::usage() const
+{
+    std::lock_guard<std::mutex> guard(mMutex);
+    std::vector<UsbBandwidthUsage> result;
+    result.reserve(mNodes.size());
+    for (const auto& [path, node] : mNodes) { result.emplace_back(node); }
+    return result;
+}
+
+void UsbBandwidthBudget::detach()
+{
+    std::lock_guard<std::mutex> guard(mMutex);
+    mContext = nullptr;
+}
+
+//class UsbHost
+UsbHost::UsbHost(const std::function<void(const UsbDevice_sptr_t&)>& plugged_in_cb, bool verbose, bool debug)
+    : UsbHost([verbose, debug]() { UsbHostOptions options; options.verbose = verbose; options.debug = debug; return options; }(), plugged_in_cb)
+{
+}
+
+UsbHost::UsbHost(const UsbHostOptions& options, const std::function<void(const UsbDevice_sptr_t&)>& plugged_in_cb)
+    : mLibUsbContext(nullptr)
+    , mLibUsbHotPlugCbHandles()
+    , mLastLibUsbError(0)
+    , mHotPlugMutex()
+    , mDevices(std::make_shared<const UsbDeviceMap>())
+    , mRegistryEpoch(0)
+    , mEpochMutex()
+    , mEpochCondVar()
+    , mWorker()
+    , mPool(options.pool_threads)
+    , mPluggedInCallback(plugged_in_cb)
+    , mFilter(options.filter)
+    , mEventCallback(options.event_cb)
+    , mEventWindow(options.event_window)
+    , mEventMutex()
+    , mPendingEvents()
+    , mEventFlushScheduled(false)
+    , mPrefetchStrings(options.prefetch_strings || options.transparent_reconnect)
+    , mProbeCallback(options.probe_cb)
+    , mProbeConcurrency(std::max<uint32_t>(1, options.probe_concurrency_per_bus))
+    , mProbeTimeout(options.probe_timeout)
+    , mEnumerationMutex()
+    , mEnumerating(false)
+    , mEnumerated()
+    , mIdentityCachePath(options.identity_cache_path)
+    , mIdentityCache()
+    , mRescanIgnored()
+    , mAutoDetachKernelDriver(options.auto_detach_kernel_driver)
+    , mTransparentReconnect(options.transparent_reconnect)
+    , mReconnectTimeout(options.reconnect_timeout)
+    , mLostMutex()
+    , mLostDevices()
+    , mReconnecting()
+    , mBandwidthBudget()
+    , mExecutor(std::make_shared<UsbDevice::Executor>())
+{
+    loadIdentityCache();
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x0100010A)
+    {   //libusb 1.0.27 takes the option per context
+        libusb_init_option init_option{};
+        init_option.option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY;
+        mLastLibUsbError.store(libusb_init_context(&mLibUsbContext, &init_option, options.no_device_discovery ? 1 : 0));
+    }
+#else
+    if (options.no_device_discovery)
+    {   //must be set before libusb_init(), it affects every context created afterwards and cannot be reverted
+        libusb_set_option(nullptr, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
+    }
+    mLastLibUsbError.store(libusb_init(&mLibUsbContext));
+#endif
+    if (mLastLibUsbError.load() != LIBUSB_SUCCESS)
+    { mLibUsbContext = nullptr; }
+    else 
+    { mExecutor->context = std::shared_ptr<libusb_context>(mLibUsbContext, libusb_exit); }
+    if (mLibUsbContext && (options.verbose || options.debug))
+    {
+        auto log_level = options.debug ? libusb_log_level::LIBUSB_LOG_LEVEL_DEBUG : libusb_log_level::LIBUSB_LOG_LEVEL_WARNING;
+        mLastLibUsbError.store(libusb_set_option(mLibUsbContext, LIBUSB_OPTION_LOG_LEVEL, log_level));
+    }
+
+    //devices keep the budget, it outlives the context if they outlive the host
+    mBandwidthBudget = std::make_shared<UsbBandwidthBudget>(mLibUsbContext, options.bandwidth_policy, options.bandwidth_usable_fraction, options.bandwidth_cb);
+    if (mLibUsbContext && (mLastLibUsbError.load() == LIBUSB_SUCCESS))
+    {
+        if (mPluggedInCallback || mEventCallback || mTransparentReconnect) { mWorker.start(true); }
+        if (mPool.start()) { mExecutor->pool = &mPool; }
+        if (options.no_device_discovery)
+        {
+            //devices are added by wrapSysDevice() only
+        }
+        else if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        {
+            {   //devices already connected are reported synchronously by LIBUSB_HOTPLUG_ENUMERATE, collect them
+                std::lock_guard<std::mutex> enumeration_guard(mEnumerationMutex);
+                mEnumerating = true;
+            }
+            //libusb matches one vendor/product pair per callback, so every pair gets its own registration
+            std::vector<UsbDeviceId> ids = mFilter.ids;
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end(), [](const UsbDeviceId& a, const UsbDeviceId& b) { return !(a < b) && !(b < a); }), ids.end());
+            if (ids.empty()) { ids.emplace_back(); }
+            for (const auto& id : ids)
+            {
+                int handle = -1;
+                int res = libusb_hotplug_register_callback(mLibUsbContext
+                    , (libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+                    , libusb_hotplug_flag::LIBUSB_HOTPLUG_ENUMERATE
+                    , mFilter.ids.empty() ? LIBUSB_HOTPLUG_MATCH_ANY : id.vendor /*vendor_id*/
+                    , mFilter.ids.empty() ? LIBUSB_HOTPLUG_MATCH_ANY : id.product /*product_id*/
+                    , LIBUSB_HOTPLUG_MATCH_ANY /*dev_class, per interface classes are filtered in acceptDevice()*/
+                    , libusbHotPlugCallback
+                    , this
+                    , &handle);
+                if (res == LIBUSB_SUCCESS) { mLibUsbHotPlugCbHandles.emplace_back(handle); }
+                else { mLastLibUsbError.store(res); }
+            }
+            std::vector<std::shared_ptr<libusb_device>> found;
+            {
+                std::lock_guard<std::mutex> enumeration_guard(mEnumerationMutex);
+                mEnumerating = false;
+                found.swap(mEnumerated);
+            }
+            enumerateDevices(found);
+        }
+        else
+        {
+            discoverDevices();
+            if (options.rescan_interval.count() > 0)
+            {
+                mWorker.start(true);
+                mWorker.schedulePeriodic(options.rescan_interval, [this]() { rescanDevices(); });
+            }
+            mLastLibUsbError.store(LIBUSB_ERROR_NOT_SUPPORTED);
+        }
+    }
+}
+
+UsbHost::~UsbHost()
+{
+    if (mLibUsbContext)
+    {
+        for (auto handle : mLibUsbHotPlugCbHandles) { libusb_hotplug_deregister_callback(mLibUsbContext, handle); }
+        mWorker.stop();
+        {   //devices may outlive the host, their later async opens fail
+            std::lock_guard<std::mutex> executor_guard(mExecutor->mutex);
+            mExecutor->pool = nullptr;
+        }
+        mPool.stop();
+        saveIdentityCache();
+        closeDevices();
+        mBandwidthBudget->detach();
+        mRescanIgnored.clear();
+        mEnumerated.clear();
+        //libusb_exit() runs once the last UsbDevice still held by the application is destroyed
+        mExecutor.reset();
+    }
+}
+
+libusb_context* UsbHost::native() const noexcept { return mLibUsbContext; }
+
+int32_t UsbHost::lastLibUsbError() const noexcept
+{
+    return mLastLibUsbError.load();
+}
+
+UsbDevice_sptr_t UsbHost::getDevice(uint16_t vendor_id, uint16_t product_id) const
+{
+    const auto devices = devicesSnapshot();
+    for (const auto& [path, device] : *devices)
+    {
+        const auto& id = device->id();
+        if ((id.vendor == vendor_id) && (id.product == product_id)) { return device; }
+    }
+    return nullptr;
+}
+
+UsbDevice_sptr_t UsbHost::getDevice(const UsbDevicePath& path) const
+{
+    const auto devices = devicesSnapshot();
+    const auto it = devices->find(path);
+    if (it != devices->cend()) 
+    {
+        return it->second;
+    }
+    return nullptr;
+}
+
+std::vector<UsbDevice_sptr_t> UsbHost::getDevices(uint16_t vendor_id, uint16_t product_id) const
+{
+    std::vector<UsbDevice_sptr_t> result;
+    const auto devices = devicesSnapshot();
+    for (const auto& [path, device] : *devices)
+    {
+        const auto& id = device->id();
+        if ((id.vendor == vendor_id) && (id.product == product_id)) { result.emplace_back(device); }
+    }
+    return result;
+}
+
+UsbDevice_sptr_t UsbHost::getDeviceBySerial(const std::string& serial_number) const
+{
+    const auto devices = devicesSnapshot();
+    for (const auto& [path, device] : *devices)
+    {
+        if (device->serialNumber() == serial_number) { return device; }
+    }
+    return nullptr;
+}
+
+std::vector<UsbDevice_sptr_t> UsbHost::getDevices() const
+{
+    std::vector<UsbDevice_sptr_t> result;
+    const auto devices = devicesSnapshot();
+    result.reserve(devices->size());
+    for (const auto& [path, device] : *devices) { result.emplace_back(device); }
+    return result;
+}
+
+std::vector<UsbDevice_sptr_t> UsbHost::findDevices(const UsbDeviceQuery& query) const
+{
+    return findDevices([&query](const UsbDevice& device) { return query.matches(device); });
+}
+
+std::vector<UsbDevice_sptr_t> UsbHost::findDevices(const std::function<bool(const UsbDevice&)>& predicate) const
+{
+    std::vector<UsbDevice_sptr_t> result;
+    const auto devices = devicesSnapshot();
+    for (const auto& [path, device] : *devices)
+    {
+        if (!predicate || predicate(*device)) { result.emplace_back(device); }
+    }
+    return result;
+}
+
+size_t UsbHost::countDevices(const UsbDeviceQuery& query) const
+{
+    const auto devices = devicesSnapshot();
+    return static_cast<size_t>(std::count_if(devices->begin(), devices->end(), [&query](const UsbDeviceMap::value_type& entry) { return query.matches(*entry.second); }));
+}
+
+UsbDeviceMap_csptr_t UsbHost::devicesSnapshot() const
+{
+    return mDevices.load();
+}
+
+uint64_t UsbHost::registryEpoch() const noexcept
+{
+    return mRegistryEpoch.load(std::memory_order_acquire);
+}
+
+uint64_t UsbHost::waitForRegistryChange(uint64_t epoch, std::chrono::milliseconds timeout) const
+{
+    uint64_t current = registryEpoch();
+    if (current > epoch) { return current; }
+    std::unique_lock<std::mutex> lock(mEpochMutex);
+    mEpochCondVar.wait_for(lock, timeout, [this, epoch, &current]() -> bool { return (current = registryEpoch()) > epoch; });
+    return current;
+}
+
+std::vector<UsbBandwidthUsage> UsbHost::bandwidthUsage() const
+{
+    return mBandwidthBudget->usage();
+}
+
+void UsbHost::publishSnapshot(std::shared_ptr<UsbDeviceMap>&& devices)
+{
+    mDevices.store(UsbDeviceMap_csptr_t(std::move(devices)));
+    {   //taking the mutex orders the bump against waiters that checked the epoch but have not slept yet
+        std::lock_guard<std::mutex> epoch_guard(mEpochMutex);
+        mRegistryEpoch.fetch_add(1, std::memory_order_acq_rel);
+    }
+    mEpochCondVar.notify_all();
+}
+
+UsbDevice_sptr_t UsbHost::wrapSysDevice(intptr_t sys_dev, const std::optional<UsbDevicePath>& path)
+{
+    if (!mLibUsbContext) { return nullptr; }
+    libusb_device_handle* handle = nullptr;
+    int res = libusb_wrap_sys_device(mLibUsbContext, sys_dev, &handle);
+    if (res != LIBUSB_SUCCESS)
+    {
+        mLastLibUsbError.store(res);
+        return nullptr;
+    }
+    //the caller chose the device explicitly, the filter does not apply
+    libusb_device* device = libusb_get_device(handle);
+    auto device_path = path ? path : createUsbDevicePath(device);
+    if (!device_path || (device_path->depth == 0))
+    {   //libusb has no parent information for wrapped devices, all of them would get the key of the root hub
+        device_path = UsbDevicePath(libusb_get_bus_number(device));
+        device_path->address = libusb_get_device_address(device);
+    }
+    auto device_obj = createDevice(device, false, device_path);
+    if (!device_obj)
+    {
+        libusb_close(handle);
+        mLastLibUsbError.store(LIBUSB_ERROR_IO);
+        return nullptr;
+    }
+    device_obj->adoptHandle(handle);
+    publishDevices({ device_obj }, false);
+    return device_obj;
+}
+
+int32_t UsbHost::registerLibUsbDevice(libusb_device* device) 
+{
+    {
+        std::lock_guard<std::mutex> enumeration_guard(mEnumerationMutex);
+        if (mEnumerating)
+        {   //collected and probed in parallel by enumerateDevices()
+            mEnumerated.emplace_back(libusb_ref_device(device), libusb_unref_device);
+            return 0;
+        }
+    }
+    //descriptors are read before taking the writer lock, readers never wait for it anyway
+    if (auto device_obj = createDevice(device))
+    {
+        publishDevices({ device_obj }, false);
+    }
+    return 0;
+}
+
+UsbDevice_sptr_t UsbHost::createDevice(libusb_device* device, bool apply_filter, const std::optional<UsbDevicePath>& known_path) const
+{
+    auto descriptor = readDeviceDescriptor(device);
+    auto path = known_path ? known_path : createUsbDevicePath(device);
+    if (descriptor && path)
+    {
+        const UsbDeviceId id(descriptor->idVendor, descriptor->idProduct);
+        if (!apply_filter || acceptDevice(device, id, descriptor->bDeviceClass, path.value())) 
+        { 
+            auto descriptors = UsbDescriptors::parse(device);
+            auto device_obj = UsbDevice::makeShared(device, id, path.value(), descriptors);
+            device_obj->setAutoDetachKernelDriver(mAutoDetachKernelDriver);
+            device_obj->mBandwidthBudget = mBandwidthBudget;
+            device_obj->mExecutor = mExecutor;
+            auto cached = mIdentityCache.find(path->toString());
+            if (descriptors && (cached != mIdentityCache.end()) && (cached->second.hash == descriptors->hash()))
+            {
+                std::lock_guard strings_guard(device_obj->mStringsMutex);
+                for (size_t i = 0; i < cached->second.strings.size(); ++i) { device_obj->mStrings[i] = cached->second.strings[i]; }
+                device_obj->mStringsFromCache = true;
+            }
+            return device_obj;
+        }
+    }
+    return nullptr;
+}
+
+void UsbHost::publishDevices(const std::vector<UsbDevice_sptr_t>& new_devices, bool probed)
+{
+    const auto fresh_devices = mTransparentReconnect ? reclaimLostDevices(new_devices) : new_devices;
+    std::lock_guard<std::mutex> hotplug_guard(mHotPlugMutex);
+    const auto devices = mDevices.load();//only writers modify mDevices and they hold the lock
+    std::shared_ptr<UsbDeviceMap> next;
+    for (const auto& device_obj : fresh_devices)
+    {
+        const auto& current = next ? *next : *devices;
+        auto it = current.find(device_obj->path());
+        if ((it != current.end()) && (it->second->native() == device_obj->native())) { continue; }
+        if (!next) { next = std::make_shared<UsbDeviceMap>(*devices); }
+        if (it != current.end()) 
+        { 
+            it->second->mIsValid.store(false);
+            postEvent(UsbDeviceEventType::Left, it->second); 
+        }
+        (*next)[device_obj->path()] = device_obj;
+        if (mPluggedInCallback) 
+        {
+            auto plugged_in_cb = mPluggedInCallback;
+            mWorker.push([plugged_in_cb, device_obj]() { plugged_in_cb(device_obj); });
+        }
+        postEvent(UsbDeviceEventType::Arrived, device_obj);
+        if (!probed && (mPrefetchStrings || mProbeCallback)) { mPool.push([this, device_obj]() { probeDevice(device_obj); }); }
+        //published with the cached strings right away, corrected in the background if the board was swapped
+        if (!mIdentityCachePath.empty()) { mPool.push([device_obj]() { device_obj->verifyCachedStrings(); }); }
+    }
+    if (next) { publishSnapshot(std::move(next)); }
+}
+
+void UsbHost::probeDevice(const UsbDevice_sptr_t& device) const
+{
+    if (mPrefetchStrings) { device->prefetchStrings(); }
+    if (mProbeCallback) { mProbeCallback(device); }
+}
+
+void UsbHost::enumerateDevices(const std::vector<std::shared_ptr<libusb_device>>& found)
+{
+    struct Probe
+    {
+        std::mutex                      mutex;
+        std::condition_variable         cond_var;
+        std::vector<UsbDevice_sptr_t>   ready;
+        size_t                          remaining = 0;
+        bool                            published = false;
+    };
+    auto probe = std::make_shared<Probe>();
+    probe->remaining = found.size();
+
+    //every bus gets mProbeConcurrency serialized lanes, so at most that many probes talk to the same bus at once
+    threading::KeyedStrands lanes(mPool);
+    std::map<uint8_t, uint32_t> bus_counters;
+    for (const auto& device : found)
+    {
+        const uint8_t bus = libusb_get_bus_number(device.get());
+        const uint64_t lane = (uint64_t(bus) << 32) | (bus_counters[bus]++ % mProbeConcurrency);
+        lanes.push(lane, [this, probe, device]()
+        {
+            auto device_obj = createDevice(device.get());
+            if (device_obj) { probeDevice(device_obj); }
+            std::unique_lock<std::mutex> lock(probe->mutex);
+            if (probe->published)
+            {   //timed out, the device joins the registry on its own
+                lock.unlock();
+                if (device_obj) { publishDevices({ device_obj }, true); }
+                return;
+            }
+            if (device_obj) { probe->ready.emplace_back(device_obj); }
+            if (--probe->remaining == 0) { probe->cond_var.notify_one(); }
+        });
+    }
+
+    std::vector<UsbDevice_sptr_t> ready;
+    {
+        std::unique_lock<std::mutex> lock(probe->mutex);
+        probe->cond_var.wait_for(lock, mProbeTimeout, [&probe]() -> bool { return probe->remaining == 0; });
+        probe->published = true;
+        ready.swap(probe->ready);
+    }
+    std::sort(ready.begin(), ready.end(), [](const UsbDevice_sptr_t& a, const UsbDevice_sptr_t& b) { return a->path() < b->path(); });
+    publishDevices(ready, true);
+    saveIdentityCache();
+}
+
+void UsbHost::loadIdentityCache()
+{
+    if (mIdentityCachePath.empty()) { return; }
+    std::ifstream file(mIdentityCachePath);
+    std::string line;
+    //line format: path \t hash \t manufacturer \t product \t serial, strings prefixed by '=' if known or '?' if not read yet
+    while (std::getline(file, line))
+    {
+        std::vector<std::string> fields;
+        std::istringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, '\t')) { fields.emplace_back(field); }
+        if (fields.size() != 5) { continue; }
+        IdentityCacheEntry entry;
+        try { entry.hash = std::stoull(fields[1], nullptr, 16); }
+        catch (...) { continue; }
+        for (size_t i = 0; i < entry.strings.size(); ++i)
+        {
+            const auto& value = fields[2 + i];
+            if (!value.empty() && (value[0] == '=')) { entry.strings[i] = unescapeCacheField(value.substr(1)); }
+        }
+        mIdentityCache[fields[0]] = entry;
+    }
+}
+
+void UsbHost::saveIdentityCache() const
+{
+    if (mIdentityCachePath.empty()) { return; }
+    const std::string temporary = mIdentityCachePath + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        if (!file) { return; }
+        const auto devices = devicesSnapshot();
+        for (const auto& [path, device] : *devices)
+        {
+            if (!device->descriptors()) { continue; }
+            std::lock_guard strings_guard(device->mStringsMutex);
+            char hash[17];
+            snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(device->descriptors()->hash()));
+            file << path.toString() << '\t' << hash;
+            //strings not confirmed by the device yet are written back as loaded, the next start verifies them again
+            const IdentityCacheEntry* loaded = nullptr;
+            if (device->mStringsFromCache)
+            {
+                auto cached = mIdentityCache.find(path.toString());
+                if ((cached != mIdentityCache.end()) && (cached->second.hash == device->descriptors()->hash())) { loaded = &cached->second; }
+            }
+            for (size_t i = 0; i < UsbDevice::STRING_COUNT; ++i) 
+            {
+                std::optional<std::string> value;
+                if (loaded) { value = loaded->strings[i]; }
+                else if (!device->mStringsFromCache) { value = device->mStrings[i]; }
+                file << '\t' << (value ? ("=" + escapeCacheField(value.value())) : std::string("?")); 
+            }
+            file << '\n';
+        }
+        if (!file.flush()) { return; }
+    }
+    //rename is atomic, a crash never leaves a half written cache behind
+    std::rename(temporary.c_str(), mIdentityCachePath.c_str());
+}
+
+int32_t UsbHost::unregisterLibUsbDevice(libusb_device* device)
+{
+    {
+        std::lock_guard<std::mutex> enumeration_guard(mEnumerationMutex);
+        if (mEnumerating)
+        {
+            auto same = [device](const std::shared_ptr<libusb_device>& other) { return other.get() == device; };
+            mEnumerated.erase(std::remove_if(mEnumerated.begin(), mEnumerated.end(), same), mEnumerated.end());
+        }
+    }
+    if (auto path = createUsbDevicePath(device))
+    {
+        removeDevices({ std::make_pair(path.value(), device) });
+    }
+    return 0;
+}
+
+void UsbHost::removeDevices(const std::vector<std::pair<UsbDevicePath, libusb_device*>>& removed)
+{
+    std::lock_guard<std::mutex> hotplug_guard(mHotPlugMutex);
+    const auto devices = mDevices.load();
+    std::shared_ptr<UsbDeviceMap> next;
+    for (const auto& [path, device] : removed)
+    {
+        const auto& current = next ? *next : *devices;
+        auto it = current.find(path);
+        //a different device may already occupy the port if events were reordered
+        if ((it == current.end()) || (it->second->native() != device)) 
+        { 
+            if (mTransparentReconnect)
+            {   //the new hardware of an in-flight rebind left before it was published
+                std::lock_guard<std::mutex> lost_guard(mLostMutex);
+                auto reconnecting = mReconnecting.find(path);
+                if ((reconnecting != mReconnecting.end()) && (reconnecting->second == device)) { mReconnecting.erase(reconnecting); }
+            }
+            continue; 
+        }
+        auto device_obj = it->second;
+        if (!next) { next = std::make_shared<UsbDeviceMap>(*devices); }
+        next->erase(path);
+        device_obj->mIsValid.store(false);
+        if (mTransparentReconnect) { loseDevice(device_obj); }
+        else { postEvent(UsbDeviceEventType::Left, device_obj); }
+    }
+    if (next) { publishSnapshot(std::move(next)); }
+}
+
+void UsbHost::loseDevice(const UsbDevice_sptr_t& device)
+{
+    LostDevice lost{ device, std::chrono::steady_clock::now(), std::nullopt };
+    {
+        std::lock_guard strings_guard(device->mStringsMutex);
+        lost.serial_number = device->mStrings[UsbDevice::SERIAL_NUMBER];
+    }
+    UsbDevice_sptr_t displaced;
+    {
+        std::lock_guard<std::mutex> lost_guard(mLostMutex);
+        auto& entry = mLostDevices[device->path()];
+        displaced = entry.device;
+        entry = lost;
+    }
+    //an earlier device lost at the same port is not coming back there
+    if (displaced) { postEvent(UsbDeviceEventType::Left, displaced); }
+    //stream hooks run on the worker in order, a suspend always precedes the matching resume
+    mWorker.push([device]() { device->suspendStreams(); });
+    mWorker.schedule(mReconnectTimeout, [this, device]() { expireLostDevice(device); });
+}
+
+void UsbHost::expireLostDevice(const UsbDevice_sptr_t& device)
+{
+    {
+        std::lock_guard<std::mutex> lost_guard(mLostMutex);
+        auto it = mLostDevices.find(device->path());
+        //reconnected or replaced by a later loss meanwhile
+        if ((it == mLostDevices.end()) || (it->second.device != device)) { return; }
+        mLostDevices.erase(it);
+    }
+    postEvent(UsbDeviceEventType::Left, device);
+}
+
+std::vector<UsbDevice_sptr_t> UsbHost::reclaimLostDevices(const std::vector<UsbDevice_sptr_t>& new_devices)
+{
+    std::vector<UsbDevice_sptr_t> fresh_devices;
+    std::vector<UsbDevice_sptr_t> displaced;
+    fresh_devices.reserve(new_devices.size());
+    {
+        std::lock_guard<std::mutex> lost_guard(mLostMutex);
+        for (const auto& device_obj : new_devices)
+        {
+            const auto& path = device_obj->path();
+            auto reconnecting = mReconnecting.find(path);
+            //already being rebound, e.g. seen again by a rescan
+            if ((reconnecting != mReconnecting.end()) && (reconnecting->second == device_obj->native())) { continue; }
+            auto it = mLostDevices.find(path);
+            if (it == mLostDevices.end())
+            {
+                fresh_devices.emplace_back(device_obj);
+                continue;
+            }
+            const bool same_descriptors = device_obj->descriptors() && it->second.device->descriptors()
+                && (device_obj->descriptors()->hash() == it->second.device->descriptors()->hash());
+            if (!same_descriptors)
+            {   //a different device took the port, the lost one is not coming back there
+                displaced.emplace_back(it->second.device);
+                mLostDevices.erase(it);
+                fresh_devices.emplace_back(device_obj);
+                continue;
+            }
+            //reopening talks to the device, it is not done on the hotplug thread
+            auto lost = it->second;
+            mLostDevices.erase(it);
+            mReconnecting[path] = device_obj->native();
+            mPool.push([this, lost, device_obj]() { reconnectDevice(lost, device_obj); });
+        }
+    }
+    for (const auto& device : displaced) { postEvent(UsbDeviceEventType::Left, device); }
+    return fresh_devices;
+}
+
+void UsbHost::reconnectDevice(const LostDevice& lost, const UsbDevice_sptr_t& fresh)
+{
+    const auto& device = lost.device;
+    const auto& path = device->path();
+    //the cached serial of the new object may come from the identity cache, which cannot tell identical boards apart
+    const bool same_identity = !lost.serial_number || lost.serial_number->empty() || (fresh->readString(UsbDevice::SERIAL_NUMBER) == lost.serial_number);
+    const bool rebound = same_identity && device->rebind(fresh->native());
+    bool current = false;
+    bool published = false;
+    {
+        std::lock_guard<std::mutex> hotplug_guard(mHotPlugMutex);
+        {
+            std::lock_guard<std::mutex> lost_guard(mLostMutex);
+            auto it = mReconnecting.find(path);
+            current = (it != mReconnecting.end()) && (it->second == fresh->native());
+            if (current) { mReconnecting.erase(it); }
+        }
+        //the new hardware may have left meanwhile, or another device may have been published at the port
+        const auto devices = mDevices.load();
+        if (rebound && current && (devices->find(path) == devices->end()))
+        {
+            auto next = std::make_shared<UsbDeviceMap>(*devices);
+            (*next)[path] = device;
+            publishSnapshot(std::move(next));
+            published = true;
+        }
+    }
+    if (published)
+    {
+        postEvent(UsbDeviceEventType::Reconnected, device, std::chrono::steady_clock::now() - lost.since);
+        mWorker.push([device]() { device->resumeStreams(); });
+        return;
+    }
+    if (rebound)
+    {   //bound to hardware it cannot own
+        device->mIsValid.store(false);
+        device->close();
+    }
+    //a different device, it cannot be restored or it is gone again, the lost one is gone for good
+    postEvent(UsbDeviceEventType::Left, device);
+    if (current && !rebound) { publishDevices({ fresh }, false); }
+}
+
+void UsbHost::rescanDevices()
+{
+    libusb_device** device_list = nullptr;
+    auto device_number = libusb_get_device_list(mLibUsbContext, &device_list);
+    if (device_number < 0) 
+    { 
+        mLastLibUsbError.store(static_cast<int32_t>(device_number));
+        return; 
+    }
+    const auto devices = devicesSnapshot();
+    std::vector<UsbDevice_sptr_t> arrived;
+    std::map<UsbDevicePath, std::shared_ptr<libusb_device>> ignored;
+    std::vector<UsbDevicePath> present;
+    present.reserve(static_cast<size_t>(device_number));
+    for (ssize_t i = 0; i < device_number; ++i)
+    {
+        libusb_device* device = device_list[i];
+        auto path = createUsbDevicePath(device);
+        if (!path) { continue; }
+        auto it = devices->find(path.value());
+        if ((it != devices->end()) && (it->second->native() == device)) 
+        {   //unchanged, the common case
+            present.emplace_back(path.value());
+            continue; 
+        }
+        auto ignored_it = mRescanIgnored.find(path.value());
+        if ((ignored_it != mRescanIgnored.end()) && (ignored_it->second.get() == device))
+        {   //filtered out before, do not parse it again
+            ignored.emplace(path.value(), ignored_it->second);
+            continue;
+        }
+        if (auto device_obj = createDevice(device)) 
+        { 
+            present.emplace_back(path.value());
+            arrived.emplace_back(device_obj); 
+        }
+        else { ignored.emplace(path.value(), std::shared_ptr<libusb_device>(libusb_ref_device(device), libusb_unref_device)); }
+    }
+    mRescanIgnored.swap(ignored);
+    if (mTransparentReconnect)
+    {
+        std::lock_guard<std::mutex> lost_guard(mLostMutex);
+        for (auto it = mReconnecting.begin(); it != mReconnecting.end();)
+        {   //the new hardware of an in-flight rebind left before it was published
+            const bool listed = (std::find(device_list, device_list + device_number, it->second) != device_list + device_number);
+            it = listed ? std::next(it) : mReconnecting.erase(it);
+        }
+    }
+
+    std::sort(present.begin(), present.end());
+    std::vector<std::pair<UsbDevicePath, libusb_device*>> removed;
+    for (const auto& [path, device] : *devices)
+    {
+        if (!std::binary_search(present.begin(), present.end(), path)) { removed.emplace_back(path, device->native()); }
+    }
+    if (!removed.empty()) { removeDevices(removed); }
+    //a replaced device at the same path is reported as left and arrived by publishDevices()
+    if (!arrived.empty()) { publishDevices(arrived, false); }
+    libusb_free_device_list(device_list, 1);
+}
+
+bool UsbHost::acceptDevice(libusb_device* device, const UsbDeviceId& id, uint8_t device_class, const UsbDevicePath& path) const
+{
+    if (!mFilter.ids.empty())
+    {
+        auto same_id = [&id](const UsbDeviceId& other) { return (other.vendor == id.vendor) && (other.product == id.product); };
+        if (std::find_if(mFilter.ids.begin(), mFilter.ids.end(), same_id) == mFilter.ids.end()) { return false; }
+    }
+    if (!mFilter.classes.empty())
+    {
+        //composite devices (0x00 per interface, 0xEF miscellaneous with IADs) and vendor specific ones
+        //carry the accepted class on their interfaces only
+        const bool class_matches = (std::find(mFilter.classes.begin(), mFilter.classes.end(), device_class) != mFilter.classes.end());
+        if (!class_matches && !hasInterfaceClass(device, mFilter.classes)) { return false; }
+    }
+    return !mFilter.predicate || mFilter.predicate(id, device_class, path);
+}
+
+void UsbHost::postEvent(UsbDeviceEventType type, const UsbDevice_sptr_t& device, std::chrono::steady_clock::duration outage)
+{
+    if (!mEventCallback) { return; }
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> event_guard(mEventMutex);
+    auto same_path = [&device](const UsbDeviceEvent& event) { return event.path == device->path(); };
+    auto it = std::find_if(mPendingEvents.rbegin(), mPendingEvents.rend(), same_path);
+    if (it == mPendingEvents.rend())
+    {
+        mPendingEvents.push_back(UsbDeviceEvent{ type, device, device->path(), now, outage });
+    }
+    else if ((it->type == UsbDeviceEventType::Arrived) && (type == UsbDeviceEventType::Reconnected))
+    {   //nobody has seen the device yet, so it simply arrived
+        it->time = now;
+    }
+    else if ((it->type == UsbDeviceEventType::Arrived) && (type == UsbDeviceEventType::Left))
+    {   //the flap is over before anybody could see it
+        mPendingEvents.erase(std::next(it).base());
+    }
+    else
+    {
+        if ((it->type == UsbDeviceEventType::Left) && (type == UsbDeviceEventType::Arrived)) { type = UsbDeviceEventType::Reset; }
+        *it = UsbDeviceEvent{ type, device, device->path(), now, outage };
+    }
+
+    if (!mEventFlushScheduled)
+    {
+        mEventFlushScheduled = true;
+        if (mEventWindow.count() > 0) { mWorker.schedule(mEventWindow, [this]() { flushEvents(); }); }
+        else { mWorker.push([this]() { flushEvents(); }); }
+    }
+}
+
+void UsbHost::flushEvents()
+{
+    std::vector<UsbDeviceEvent> events;
+    {
+        std::lock_guard<std::mutex> event_guard(mEventMutex);
+        events.swap(mPendingEvents);
+        mEventFlushScheduled = false;
+    }
+    if (!events.empty()) { mEventCallback(events); }
+}
+
+void UsbHost::discoverDevices()
+{
+    if (mLibUsbContext)
+    {
+        std::vector<std::shared_ptr<libusb_device>> found;
+        libusb_device** device_list = nullptr;
+        auto device_number = libusb_get_device_list(mLibUsbContext, &device_list);
+        if (device_number > 0)
+        {
+            for (int i = 0; i < device_number; ++i)
+            {
+                found.emplace_back(libusb_ref_device(device_list[i]), libusb_unref_device);
+            }
+        }
+        libusb_free_device_list(device_list, 1);
+        enumerateDevices(found);
+    }
+}
+
+void UsbHost::closeDevices()
+{
+    {
+        std::lock_guard<std::mutex> lost_guard(mLostMutex);
+        for (auto& [path, lost] : mLostDevices) { lost.device->close(); }
+        mLostDevices.clear();
+    }
+    const auto devices = devicesSnapshot();
+    for (auto& [path, device] : *devices) 
     {
         if (device) { device->close(); }
     }
@@ -9,8 +9,16 @@
 #include <condition_variable>
 #include <queue>
 #include <map>
+#include <set>
+#include <array>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <optional>
+#include <future>
 
 #include "threading.h"
+#include "usb_descriptors.h"
 
 //predeclarations
 struct libusb_context;
@@ -21,10 +29,45 @@ class UsbDevice;
 typedef std::shared_ptr<UsbDevice> UsbDevice_sptr_t;
 typedef std::weak_ptr<UsbDevice> UsbDevice_wptr_t;
 
+/**
+ * An endpoint usable on an open device, resolved from the active configuration and the selected
+ * alternate setting of a claimed interface
+ */
+struct UsbEndpoint
+{
+    static constexpr size_t DEFAULT_BULK_TRANSFER_SIZE = 16384;
+    static constexpr size_t DEFAULT_ISO_PACKETS = 8;//one millisecond of high-speed microframes
+
+    uint8_t                 address = 0;
+    UsbEndpointDirection    direction = UsbEndpointDirection::Out;
+    UsbTransferType         type = UsbTransferType::Control;
+    uint16_t                max_packet_size = 0;//bits 0-10 of wMaxPacketSize
+    uint8_t                 mult = 1;//packets per (micro)frame
+    uint32_t                interval_size = 0;//bytes per service interval of periodic endpoints, see UsbEndpointDescriptor::intervalSize()
+    uint8_t                 interval = 0;//raw bInterval, its unit depends on the speed and the transfer type
+    uint8_t                 interface_number = 0;
+    uint8_t                 alt_setting = 0;
+
+    UsbEndpoint() = default;
+    UsbEndpoint(const UsbEndpointDescriptor& descriptor, const UsbAltSettingDescriptor& owner);
+    /**
+     * Returns the bytes the endpoint moves per (micro)frame or service interval: interval_size for periodic endpoints
+     * (max_packet_size * mult, or the SuperSpeed companion's bytes per interval), max_packet_size otherwise
+     */
+    size_t packetSize() const noexcept { return interval_size ? size_t(interval_size) : size_t(max_packet_size) * mult; }
+    /**
+     * Rounds the given size up to a whole number of packets, a short last packet ends a transfer early
+     * and an IN buffer that is not packet-aligned can overflow
+     * A zero size gives the default: DEFAULT_BULK_TRANSFER_SIZE for bulk, DEFAULT_ISO_PACKETS packets
+     * for isochronous and a single packet for interrupt and control endpoints
+     */
+    size_t alignedSize(size_t size = 0) const noexcept;
+};
+
 class UsbTransfer : public std::enable_shared_from_this<UsbTransfer>
 {
 protected:
-    UsbTransfer(const UsbDevice_sptr_t& device);
+    UsbTransfer(const UsbDevice_sptr_t& device, const UsbEndpoint& endpoint, size_t size);
 public:
     /**
      * Makes a new shared transfer object
@@ -32,9 +75,26 @@ public:
      * @return A shared UsbTransfer object is returned
      */
     static std::shared_ptr<UsbTransfer> makeShared(const UsbDevice_sptr_t& device);
+    /**
+     * Makes a new shared transfer object for the given endpoint
+     * @param size The size of the buffer, rounded up by UsbEndpoint::alignedSize()
+     * @return A shared UsbTransfer object is returned
+     */
+    static std::shared_ptr<UsbTransfer> makeShared(const UsbDevice_sptr_t& device, const UsbEndpoint& endpoint, size_t size = 0);
     virtual ~UsbTransfer();
+    /**
+     * Returns the endpoint of the transfer, a default constructed one if it was made without endpoint
+     */
+    const UsbEndpoint& endpoint() const noexcept;
+    /**
+     * Returns the packet-aligned transfer buffer
+     */
+    std::vector<uint8_t>& buffer() noexcept;
+    const std::vector<uint8_t>& buffer() const noexcept;
 private:
-    UsbDevice_wptr_t mUsbDevice;
+    UsbDevice_wptr_t        mUsbDevice;
+    UsbEndpoint             mEndpoint;
+    std::vector<uint8_t>    mBuffer;
 };
 typedef std::shared_ptr<UsbTransfer> UsbTransfer_sptr_t;
 
@@ -46,27 +106,165 @@ struct UsbDeviceId
     bool operator<(const UsbDeviceId& rhs) const { return (uint32_t(vendor) << 16 | uint32_t(product)) < (uint32_t(rhs.vendor) << 16 | uint32_t(rhs.product)); }
 };
 
+/**
+ * Physical location of a device: bus number and the chain of hub port numbers leading to it
+ * Stable as long as the device stays plugged into the same port, unlike the device address
+ */
+struct UsbDevicePath
+{
+    static constexpr size_t MAX_DEPTH = 7;//limit of the USB 3.0 specification
+    uint8_t                         bus;
+    uint8_t                         depth;//number of valid port numbers, zero for root hubs
+    std::array<uint8_t, MAX_DEPTH>  ports;
+    uint8_t                         address;//device address for non-root devices without port information (wrapped ones, no sysfs), zero otherwise
+    UsbDevicePath(uint8_t b = 0) : bus(b), depth(0), ports(), address(0) {}
+    bool operator<(const UsbDevicePath& rhs) const 
+    { 
+        if (bus != rhs.bus) { return bus < rhs.bus; }
+        if (depth != rhs.depth) { return depth < rhs.depth; }
+        if (ports != rhs.ports) { return ports < rhs.ports; }
+        return address < rhs.address;
+    }
+    bool operator==(const UsbDevicePath& rhs) const { return (bus == rhs.bus) && (depth == rhs.depth) && (ports == rhs.ports) && (address == rhs.address); }
+    bool operator!=(const UsbDevicePath& rhs) const { return !(*this == rhs); }
+    /**
+     * Returns the path in the same format as the Linux sysfs device names, e.g. "1-4.2"
+     * Paths made of a device address are formatted as bus@address, e.g. "1@12"
+     */
+    std::string toString() const;
+};
+
+/**
+ * Hooks of a data stream (e.g. a chain of transfers kept in flight) running on a UsbDevice
+ * They let the device pause and restart the stream when it has to give up its handle temporarily
+ */
+struct UsbStreamHandlers
+{
+    std::function<void()>   suspend;//pending transfers should be cancelled, the handle is about to go away
+    std::function<void()>   resume;//the device is usable again with the same configuration, interfaces and alternate settings
+    uint64_t                bytes_per_second = 0;//declared rate charged against the bandwidth budget of the host
+};
+
+/**
+ * Negotiated link speed of a device, mapped from libusb_speed, speeds this wrapper does not know are Unknown
+ */
+enum class UsbSpeed
+{
+    Unknown = 0,
+    Low,//1.5 Mbit/s
+    Full,//12 Mbit/s
+    High,//480 Mbit/s
+    Super,//5 Gbit/s
+    SuperPlus,//10 Gbit/s
+    SuperPlusX2//20 Gbit/s, reported by libusb 1.0.27 and later
+};
+
+class UsbBandwidthBudget;
+
+enum class UsbResetMode
+{
+    Plain,//only the port is reset, restoring the state is left to the system and the caller
+    PreserveState//streams are suspended, the state is reapplied after the reset and the streams are resumed
+};
+
+/**
+ * Outcome and timing of UsbDevice::resetPort()
+ */
+struct UsbResetReport
+{
+    bool                                    success = false;
+    bool                                    reenumerated = false;//the device came back as a new device, the object is no longer valid
+    int32_t                                 error = 0;//libusb error of the failed step
+    size_t                                  streams = 0;//number of suspended streams
+    std::chrono::steady_clock::duration     suspend{};
+    std::chrono::steady_clock::duration     reset{};
+    std::chrono::steady_clock::duration     restore{};//reapplying the configuration, interface claims and alternate settings
+    std::chrono::steady_clock::duration     resume{};
+    std::chrono::steady_clock::duration     total() const { return suspend + reset + restore + resume; }
+};
+
 class UsbDevice : public std::enable_shared_from_this<UsbDevice>
 {
 protected:
-    UsbDevice(libusb_device* device, const UsbDeviceId& id);
+    UsbDevice(libusb_device* device, const UsbDeviceId& id, const UsbDevicePath& path, const UsbDescriptors_csptr_t& descriptors);
 public:
     /**
     * Makes a new shared UsbDevice object
+    * @param descriptors Parsed descriptors of the device, parsed from the device if nullptr is given
     * @return A shared UsbDevice object is returned
     */
-    static std::shared_ptr<UsbDevice> makeShared(libusb_device* device, const UsbDeviceId& id);
+    static std::shared_ptr<UsbDevice> makeShared(libusb_device* device, const UsbDeviceId& id, const UsbDevicePath& path, const UsbDescriptors_csptr_t& descriptors = nullptr);
     virtual ~UsbDevice();
     /**
      * Returns a structure that identifies the device by vendor and product ids
      */
     const UsbDeviceId& id() const noexcept;
+    /**
+     * Returns the physical location of the device, identical devices are told apart by it
+     */
+    const UsbDevicePath& path() const noexcept;
+    /**
+     * Returns every descriptor of the device parsed once at registration
+     * @return A shared read-only object is returned, or nullptr if the descriptors could not be read
+     */
+    const UsbDescriptors_csptr_t& descriptors() const noexcept;
+    /**
+     * Returns the manufacturer string of the device
+     * Read on first use (opening the device temporarily if needed) and cached for the lifetime of the object
+     * @return An empty string is returned if the device has no such string or it cannot be read
+     */
+    std::string manufacturer() const;
+    /**
+     * Returns the product string of the device, see manufacturer()
+     */
+    std::string product() const;
+    /**
+     * Returns the serial number string of the device, see manufacturer()
+     */
+    std::string serialNumber() const;
+    /**
+     * Reads and caches every standard string that is not cached yet, see manufacturer()
+     */
+    void prefetchStrings() const;
     /**
      * Returns a pointer to the native libusb_device
      */
     libusb_device* native() const noexcept;
     /**
-     * Returns a pointer to the native libusb_device_handle
+     * Keeps the native handle of an open device alive while I/O is performed on it, see acquireHandle()
+     * Obtaining and dropping a lease takes no lock, close() and resetPort() wait for all leases to be dropped
+     * before they lock the device, so a lease holder may call any other member while it waits
+     * The lease keeps the UsbDevice alive, a thread MUST NOT call close() or resetPort() while it holds a lease
+     */
+    class HandleLease
+    {
+    public:
+        HandleLease() noexcept;
+        HandleLease(HandleLease&& other) noexcept;
+        HandleLease& operator=(HandleLease&& other) noexcept;
+        HandleLease(const HandleLease&) = delete;
+        HandleLease& operator=(const HandleLease&) = delete;
+        ~HandleLease();
+
+        libusb_device_handle* get() const noexcept { return mHandle; }
+        explicit operator bool() const noexcept { return mHandle != nullptr; }
+        void reset() noexcept;
+    private:
+        friend class UsbDevice;
+        HandleLease(std::shared_ptr<const UsbDevice>&& device, libusb_device_handle* handle) noexcept;
+
+        std::shared_ptr<const UsbDevice> mDevice;
+        libusb_device_handle*   mHandle;
+    };
+    /**
+     * Returns a lease on the native libusb_device_handle, it is empty if the device is not open,
+     * if close() or resetPort() is in progress, or if the object is not owned by a shared_ptr
+     * Lock-free, meant to be used by every transfer submission
+     */
+    HandleLease acquireHandle() const noexcept;
+    /**
+     * Returns a pointer to the native libusb_device_handle without taking a lock
+     * The handle may be closed any time by close() or resetPort(), use acquireHandle() to keep it alive
      */
     libusb_device_handle* native_handle() const noexcept;
     /**
@@ -83,9 +281,68 @@ public:
      * @param config_number The number of the configuration you wish to activate, -1 will put the device in unconfigured state
      * @param interface_number The number of the interface you wish to claim, -1 will claim no interface at all
      *
+     * Interfaces claimed before are released, use claimInterface() to claim further interfaces
+     *
      * @return True is returned on success, otherwise false and lastLibUsbError() may return a propriate error
      */
     bool open(int32_t config_number = -1, int32_t interface_number = -1);
+    /**
+     * Same as open() but runs on the thread pool of the host and returns immediately
+     * Opens of the same device are serialized, different devices are opened in parallel,
+     * lock-free readers of the handle (see acquireHandle()) never wait for a half-opened device
+     * Runs synchronously if the device is not registered by a UsbHost
+     * If its host has been destroyed, it fails at once and lastLibUsbError() returns LIBUSB_ERROR_NO_DEVICE
+     * @param callback Called on the pool with the result of open() after the future is made ready
+     * @return A future getting the result of open(), it reports a broken promise if the host is destroyed before the open ran
+     */
+    std::future<bool> openAsync(int32_t config_number = -1, int32_t interface_number = -1, const std::function<void(bool)>& callback = nullptr);
+    /**
+     * Claims an interface in addition to the already claimed ones, opening the device if needed
+     * @param alt_setting If non-negative the alternate setting is also selected, see setAltSetting()
+     * @return True is returned on success, otherwise false and lastLibUsbError() may return a propriate error
+     */
+    bool claimInterface(int32_t interface_number, int32_t alt_setting = -1);
+    /**
+     * Releases a claimed interface
+     * @return True is returned on success, otherwise false and lastLibUsbError() may return a propriate error
+     */
+    bool releaseInterface(int32_t interface_number);
+    /**
+     * Selects an alternate setting of a claimed interface, e.g. a high-bandwidth one
+     * @return True is returned on success, otherwise false and lastLibUsbError() may return a propriate error
+     */
+    bool setAltSetting(int32_t interface_number, int32_t alt_setting);
+    /**
+     * Returns the claimed interfaces mapped to their selected alternate settings
+     */
+    std::map<int32_t, int32_t> claimedInterfaces() const;
+    /**
+     * Returns the configuration activated by open(), or -1 if none was activated
+     */
+    int32_t configuration() const;
+    /**
+     * If enabled, kernel drivers (e.g. cdc_acm, usbhid) bound to an interface are detached before claiming it
+     * and reattached when the interface is released, on close() and when the object is destroyed
+     * Has no effect on platforms without LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER
+     */
+    void setAutoDetachKernelDriver(bool enable);
+    /**
+     * Returns the negotiated speed of the link of the device
+     */
+    UsbSpeed speed() const;
+    /**
+     * Registers the hooks of a stream, see UsbStreamHandlers
+     * With UsbHostOptions::transparent_reconnect streams are suspended when the device is lost and resumed
+     * on the worker thread of the host once it has been reconnected
+     * The declared rate is charged against the link of the device and every hub and bus above it, see UsbBandwidthPolicy
+     * @return The id of the stream is returned, used by removeStream(), or zero if the bandwidth budget refused
+     * the stream, lastLibUsbError() returns LIBUSB_ERROR_BUSY then
+     */
+    uint32_t addStream(const UsbStreamHandlers& handlers);
+    /**
+     * Unregisters the hooks of a stream
+     */
+    void removeStream(uint32_t stream_id);
     /**
      * Close an open device
      */
@@ -101,6 +358,16 @@ public:
      * @return True is returned on success, otherwise false is returned and the UsbDevice object is no longer valid
      */
     bool resetPort();
+    /**
+     * Perform a USB port reset in the given mode and time every step
+     *
+     * With UsbResetMode::PreserveState the streams are suspended first (their pending transfers are cancelled),
+     * in-flight handle leases are waited for, then after the reset the configuration, interface claims and
+     * alternate settings are reapplied (which also resets the data toggles of the endpoints) and the streams are resumed
+     * If the device re-enumerates, the claims are kept and the streams stay suspended, so that
+     * UsbHostOptions::transparent_reconnect can restore both on the new device
+     */
+    UsbResetReport resetPort(UsbResetMode mode);
     /**
      * Clear the halt/stall condition for an endpoint. 
      * Endpoints with halt status are unable to receive or transmit data until the halt condition is stalled.
@@ -118,16 +385,309 @@ public:
      * @return On success a shared UsbTransfer object is returned, otherwise nullptr
      */
     UsbTransfer_sptr_t newTransfer();
+    /**
+     * Returns a new UsbTransfer object for the given endpoint with a packet-aligned buffer
+     * @param size The size of the buffer, zero selects the default of the endpoint, see UsbEndpoint::alignedSize()
+     * @return On success a shared UsbTransfer object is returned, otherwise nullptr if the endpoint
+     * is not part of a claimed interface and lastLibUsbError() returns LIBUSB_ERROR_NOT_FOUND
+     */
+    UsbTransfer_sptr_t newTransfer(uint8_t endpoint_address, size_t size = 0);
+    /**
+     * Returns the endpoints of the claimed interfaces in their selected alternate settings within the
+     * configuration activated by open(), or within the device's active configuration if none was activated explicitly
+     * Empty if the device is closed, unconfigured or the active configuration could not be queried (see lastLibUsbError())
+     */
+    std::vector<UsbEndpoint> endpoints() const;
+    /**
+     * Returns the endpoint with the given address, see endpoints()
+     */
+    std::optional<UsbEndpoint> endpoint(uint8_t address) const;
+    /**
+     * Returns the first endpoint with the given direction and transfer type, so that addresses need not be hard-coded
+     */
+    std::optional<UsbEndpoint> endpoint(UsbEndpointDirection direction, UsbTransferType type) const;
 private:
+    friend class UsbHost;
+
+    enum StringIndex { MANUFACTURER = 0, PRODUCT, SERIAL_NUMBER, STRING_COUNT };
+    static constexpr uint32_t HANDLE_RETIRING = 1;
+    static constexpr uint32_t HANDLE_USER = 2;
+    void releaseHandle() const noexcept;
+    /**
+     * Refuses new leases and waits for the existing ones to be dropped for its lifetime
+     * Taken before mHandleMutex, so that lease holders can still lock it while they finish
+     */
+    class HandleRetirement
+    {
+    public:
+        explicit HandleRetirement(UsbDevice& device);
+        ~HandleRetirement();
+    private:
+        UsbDevice&                      mDevice;
+        std::lock_guard<std::mutex>     mGuard;
+    };
+    std::string cachedString(StringIndex which) const;
+    //the following functions expect mHandleMutex to be held
+    bool openHandle();
+    void publishHandle();
+    bool applyAltSetting(int32_t interface_number, int32_t alt_setting);
+    void releaseInterfaces();
+    bool claim(int32_t interface_number);
+    void reattachKernelDriver(int32_t interface_number);
+    bool fetchStrings(const std::vector<StringIndex>& which) const;//mStringsMutex MUST be held
+    std::optional<std::string> readString(StringIndex which) const;//reads from the device even if cached, updates the cache
+    void verifyCachedStrings() const;//re-reads strings seeded from the identity cache
+    size_t suspendStreams();
+    size_t resumeStreams();
+    bool restoreState();//mHandleMutex MUST be held
+    /**
+     * Moves the object onto a re-enumerated instance of the same device, the handle is reopened
+     * and the configuration, claimed interfaces and alternate settings are restored if it was open
+     */
+    bool rebind(libusb_device* device);
+    void adoptHandle(libusb_device_handle* handle);//takes ownership of an already open handle
+
     UsbDeviceId             mId;
-    libusb_device* const    mLibUsbDeviceContext;
-    libusb_device_handle*   mLibUsbDeviceHandle;
-    std::atomic_int32_t     mLastLibUsbError;
+    UsbDevicePath           mPath;
+    UsbDescriptors_csptr_t  mDescriptors;
+    std::atomic<libusb_device*> mLibUsbDeviceContext;//replaced only by rebind()
+    libusb_device_handle*   mLibUsbDeviceHandle;//owned, guarded by mHandleMutex
+    std::atomic<libusb_device_handle*> mPublishedHandle;//lock-free view for leases, nullptr while retired
+    mutable std::atomic<uint32_t> mHandleUsers;//HANDLE_USER per lease, bit 0 is set while a HandleRetirement exists
+    std::mutex              mRetireMutex;//serializes HandleRetirements, locked before mHandleMutex
+    mutable std::atomic_int32_t mLastLibUsbError;
     mutable std::mutex      mHandleMutex;
-    int                     mInterfaceNumber;
+    int32_t                 mConfiguration;
+    std::map<int32_t, int32_t> mClaimedInterfaces;//interface number -> alternate setting
+    std::atomic_bool        mAutoDetachKernelDriver;
+    std::set<int32_t>       mDetachedInterfaces;//interfaces whose kernel driver has to be reattached
     std::atomic_bool        mIsValid;
+    mutable std::mutex                                      mStringsMutex;
+    mutable std::array<std::optional<std::string>, STRING_COUNT> mStrings;
+    mutable bool                                            mStringsFromCache;//seeded from the identity cache, not read from this device yet
+    struct Stream
+    {
+        UsbStreamHandlers                                   handlers;
+        std::vector<UsbDevicePath>                          charged;//budget nodes the rate is charged against
+        bool                                                suspended = false;//every suspend is paired with exactly one resume
+    };
+    std::mutex                                  mStreamsMutex;
+    std::map<uint32_t, Stream>                  mStreams;
+    uint32_t                                    mNextStreamId;
+    std::shared_ptr<UsbBandwidthBudget>         mBandwidthBudget;//set by UsbHost, nullptr if not hosted
+    struct Executor
+    {
+        std::mutex                                          mutex;
+        threading::ThreadPool*                              pool = nullptr;//nullptr once the host is gone
+        std::shared_ptr<libusb_context>                     context;//libusb_exit() is called when the host and all of its devices are gone
+    };
+    std::shared_ptr<Executor>                   mExecutor;//set by UsbHost, nullptr if not hosted
+    std::unique_ptr<threading::Strand>          mStrand;//created by the first openAsync(), guarded by mExecutor->mutex
+};
+
+enum class UsbBandwidthPolicy
+{
+    Ignore,//streams are only accounted
+    Report,//over-subscription is reported by UsbHostOptions::bandwidth_cb, the stream is started anyway
+    Refuse//over-subscription is reported and the stream is refused
 };
 
+/**
+ * Bandwidth accounted on a link: the bus of a root hub (depth zero path), a hub or a device
+ */
+struct UsbBandwidthUsage
+{
+    UsbDevicePath   node;
+    UsbSpeed        speed = UsbSpeed::Unknown;
+    uint64_t        capacity = 0;//usable bytes per second, see UsbHostOptions::bandwidth_usable_fraction, zero if the speed is unknown
+    uint64_t        allocated = 0;//bytes per second declared by the streams below the node
+};
+typedef std::function<void(const UsbDevice& device, const std::vector<UsbBandwidthUsage>& oversubscribed)> UsbBandwidthCallback;
+
+/**
+ * Per bus, per hub and per device bandwidth accounting of a UsbHost, shared with its devices
+ */
+class UsbBandwidthBudget
+{
+public:
+    UsbBandwidthBudget(libusb_context* context, UsbBandwidthPolicy policy, double usable_fraction, const UsbBandwidthCallback& callback);
+    /**
+     * Returns the raw signaling rate of the given speed in bytes per second
+     */
+    static uint64_t bytesPerSecond(UsbSpeed speed) noexcept;
+    /**
+     * Charges the rate against the device and every hub above it up to the root hub
+     * @param charged Receives the charged nodes, to be passed to refund()
+     * @return False is returned if the policy refused the rate, nothing is charged then
+     */
+    bool charge(const UsbDevice& device, uint64_t bytes_per_second, std::vector<UsbDevicePath>& charged);
+    void refund(const std::vector<UsbDevicePath>& charged, uint64_t bytes_per_second);
+    /**
+     * Returns the usage of every node with allocated bandwidth
+     */
+    std::vector<UsbBandwidthUsage> usage() const;
+    /**
+     * Forgets the libusb context, called by UsbHost before it is destroyed, later charges are accepted unchecked
+     */
+    void detach();
+private:
+    mutable std::mutex                          mMutex;
+    libusb_context*                             mContext;
+    const UsbBandwidthPolicy                    mPolicy;
+    const double                                mUsableFraction;
+    const UsbBandwidthCallback                  mCallback;
+    std::map<UsbDevicePath, UsbBandwidthUsage>  mNodes;
+};
+
+/**
+ * Selects the devices a UsbHost takes care of, other devices are ignored before any UsbDevice object is created
+ * All given criteria has to match, an empty criterion matches every device
+ */
+struct UsbDeviceFilter
+{
+    /**
+     * Accepted vendor and product id pairs, pushed down into libusb as separate hotplug callbacks
+     */
+    std::vector<UsbDeviceId>    ids;
+    /**
+     * Accepted class codes, matched against bDeviceClass and, if that does not match, against the bInterfaceClass
+     * of the interfaces of the active configuration, so composite devices (bDeviceClass 0x00 or 0xEF) are matched by function
+     */
+    std::vector<uint8_t>        classes;
+    /**
+     * Custom predicate called with the vendor and product ids, bDeviceClass and location of the device
+     */
+    std::function<bool(const UsbDeviceId& id, uint8_t device_class, const UsbDevicePath& path)> predicate;
+};
+
+enum class UsbDeviceEventType
+{
+    Arrived,//a new device has been registered
+    Left,//the device has been removed, the UsbDevice object is no longer valid
+    Reset,//the device left and arrived again within the coalescing window, e.g. re-enumerated after a reset
+    Reconnected//the lost device came back and the same UsbDevice object was rebound to it, see UsbHostOptions::transparent_reconnect
+};
+
+struct UsbDeviceEvent
+{
+    UsbDeviceEventType                      type;
+    UsbDevice_sptr_t                        device;//the removed object for Left, the new object for Arrived and Reset, the rebound one for Reconnected
+    UsbDevicePath                           path;
+    std::chrono::steady_clock::time_point   time;//time of the last underlying hotplug event
+    std::chrono::steady_clock::duration     outage{};//time the device was gone, set for Reconnected only
+};
+typedef std::function<void(const std::vector<UsbDeviceEvent>&)> UsbDeviceEventCallback;
+
+/**
+ * Construction options of UsbHost
+ */
+struct UsbHostOptions
+{
+    UsbDeviceFilter             filter;
+    /**
+     * Receives device lifecycle events in batches on the worker thread
+     */
+    UsbDeviceEventCallback      event_cb;
+    /**
+     * Events are collected for this long before they are delivered as one batch
+     * Within the window an arrival followed by a removal of the same path cancel out,
+     * a removal followed by an arrival is reported as a single Reset
+     */
+    std::chrono::milliseconds   event_window{ 50 };
+    /**
+     * If set the standard strings (manufacturer, product, serial number) of every registered device
+     * are read in parallel on the host's thread pool, see UsbDevice::prefetchStrings()
+     */
+    bool                        prefetch_strings = false;
+    /**
+     * Called on the host's thread pool for every new device, e.g. to open it and read identification data
+     * Devices found at startup are probed in parallel before the registry is published
+     */
+    std::function<void(const UsbDevice_sptr_t&)> probe_cb;
+    /**
+     * Maximum number of devices probed at the same time on the same bus
+     */
+    uint32_t                    probe_concurrency_per_bus = 4;
+    /**
+     * Startup waits at most this long for the probes, devices probed later are published one by one
+     */
+    std::chrono::milliseconds   probe_timeout{ 5000 };
+    /**
+     * If not empty, identification strings read from devices are persisted to this file and reused after a restart
+     * An entry is reused only if the device is at the same path and its descriptors hash to the same value,
+     * so the control transfers reading the strings are skipped for unchanged devices at startup
+     * As identical boards cannot be told apart this way, reused strings are read again from the device
+     * on the thread pool after it has been published, and only strings read from the device are persisted
+     */
+    std::string                 identity_cache_path;
+    /**
+     * Default of UsbDevice::setAutoDetachKernelDriver() for every registered device
+     */
+    bool                        auto_detach_kernel_driver = false;
+    /**
+     * If set a removed device is kept for reconnect_timeout instead of being reported as Left
+     * If a device with the same descriptors and serial number arrives at the same path meanwhile, the existing
+     * UsbDevice object is rebound to it: it is reopened, its configuration, claimed interfaces and alternate settings
+     * are restored, its streams are resumed and a single Reconnected event is reported
+     * Implies prefetch_strings, so that the serial number of a lost device is known
+     */
+    bool                        transparent_reconnect = false;
+    std::chrono::milliseconds   reconnect_timeout{ 2000 };
+    /**
+     * Tells what happens to a stream that would over-subscribe a link, see UsbDevice::addStream()
+     * Rates are checked against bandwidth_usable_fraction of the raw capacity of every link a stream uses,
+     * the rest is left for protocol overhead and traffic of devices without declared streams
+     */
+    UsbBandwidthPolicy          bandwidth_policy = UsbBandwidthPolicy::Report;
+    double                      bandwidth_usable_fraction = 0.8;
+    /**
+     * Called synchronously by UsbDevice::addStream() with the links the new stream would over-subscribe,
+     * links of unknown speed cannot be checked and are reported too (capacity zero) but never refuse a stream
+     */
+    UsbBandwidthCallback        bandwidth_cb;
+    /**
+     * If hotplug is not supported, the device list is rescanned this often on the worker thread and compared
+     * with the registry by physical path, changes are reported like hotplug events, zero disables rescanning
+     */
+    std::chrono::milliseconds   rescan_interval{ 0 };
+    /**
+     * If set libusb is initialized with LIBUSB_OPTION_NO_DEVICE_DISCOVERY, neither the bus is scanned nor
+     * hotplug is registered, devices are added by UsbHost::wrapSysDevice() only
+     * Meant for sandboxes without access to usbfs where a broker passes opened device nodes
+     * !!! With libusb older than 1.0.27 the option can only be set process-wide and cannot be reverted,
+     * every UsbHost created afterwards discovers no devices either !!!
+     */
+    bool                        no_device_discovery = false;
+    /**
+     * Number of threads of the host's thread pool, zero means the number of hardware threads
+     */
+    size_t                      pool_threads = 0;
+    bool                        verbose = false;//all libusb warnings and errors sent to stderr
+    bool                        debug = false;//all libusb debug information sent to stderr
+};
+
+/**
+ * Criteria to look up devices in the registry of a UsbHost, all given criteria has to match
+ */
+struct UsbDeviceQuery
+{
+    uint16_t                    vendor_min = 0x0000;
+    uint16_t                    vendor_max = 0xFFFF;
+    std::optional<uint16_t>     product;
+    std::optional<uint8_t>      device_class;//bDeviceClass
+    std::optional<uint8_t>      interface_class;//bInterfaceClass of any alternate setting of any configuration
+    std::optional<uint8_t>      bus;
+    std::string                 serial_prefix;//serial numbers not cached yet are read on demand
+    std::function<bool(const UsbDevice&)> predicate;
+    /**
+     * Tells if the given device matches every criterion, cheap criteria are evaluated first
+     */
+    bool matches(const UsbDevice& device) const;
+};
+
+typedef std::map<UsbDevicePath, UsbDevice_sptr_t> UsbDeviceMap;
+typedef std::shared_ptr<const UsbDeviceMap> UsbDeviceMap_csptr_t;
+
 class UsbHost
 {
 public:
@@ -141,6 +701,12 @@ public:
      * @param debug If set true all libusb debug information sent to stderr
      */
     UsbHost(const std::function<void(const UsbDevice_sptr_t&)>& plugged_in_cb = nullptr, bool verbose = false, bool debug = false);
+    /**
+     * Represents a USB host controller that only handles the devices selected by options.filter
+     * @param options See UsbHostOptions
+     * @param plugged_in_cb a callback to get a device that has been plugged in recenlty if hot plug is supported
+     */
+    UsbHost(const UsbHostOptions& options, const std::function<void(const UsbDevice_sptr_t&)>& plugged_in_cb = nullptr);
     virtual ~UsbHost();
     /**
      * Returns a pointer to the native libusb_context
@@ -153,9 +719,72 @@ public:
     int32_t lastLibUsbError() const noexcept;
     /**
      * Returns a device object identified by the given vendor id and product id
+     * If several such devices are connected the one with the lowest bus and port path is returned
      * @return A valid shared UsbDevice object is returned if exists such a device, otherwise nullptr
      */
     UsbDevice_sptr_t getDevice(uint16_t vendor_id, uint16_t product_id) const;
+    /**
+     * Returns the device object connected at the given physical location
+     * @return A valid shared UsbDevice object is returned if exists such a device, otherwise nullptr
+     */
+    UsbDevice_sptr_t getDevice(const UsbDevicePath& path) const;
+    /**
+     * Returns all device objects with the given vendor id and product id ordered by their paths
+     */
+    std::vector<UsbDevice_sptr_t> getDevices(uint16_t vendor_id, uint16_t product_id) const;
+    /**
+     * Returns the device object with the given serial number
+     * Serial numbers not read yet are read on demand, see UsbDevice::serialNumber()
+     * @return A valid shared UsbDevice object is returned if exists such a device, otherwise nullptr
+     */
+    UsbDevice_sptr_t getDeviceBySerial(const std::string& serial_number) const;
+    /**
+     * Returns all known device objects ordered by their paths
+     */
+    std::vector<UsbDevice_sptr_t> getDevices() const;
+    /**
+     * Returns the devices of the registry matching the query ordered by their paths, the bus is not rescanned
+     */
+    std::vector<UsbDevice_sptr_t> findDevices(const UsbDeviceQuery& query) const;
+    /**
+     * Returns the devices of the registry the predicate accepts ordered by their paths
+     */
+    std::vector<UsbDevice_sptr_t> findDevices(const std::function<bool(const UsbDevice&)>& predicate) const;
+    /**
+     * Returns the number of devices matching the query without collecting them
+     */
+    size_t countDevices(const UsbDeviceQuery& query) const;
+    /**
+     * Returns the current immutable snapshot of the device registry
+     * Lookups on a snapshot need no locking, hotplug events publish a new snapshot instead of modifying it
+     */
+    UsbDeviceMap_csptr_t devicesSnapshot() const;
+    /**
+     * Returns the generation of the device registry
+     * It is increased every time a snapshot with arrived or removed devices is published, so
+     * comparing it with a previously read value tells if the device set changed at the cost of one atomic load
+     */
+    uint64_t registryEpoch() const noexcept;
+    /**
+     * Blocks until the registry epoch gets greater than the given one or the timeout expires
+     * @return The current registry epoch is returned, not greater than the given one on timeout
+     */
+    uint64_t waitForRegistryChange(uint64_t epoch, std::chrono::milliseconds timeout) const;
+    /**
+     * Returns the bandwidth declared by the streams of the devices per bus, hub and device
+     */
+    std::vector<UsbBandwidthUsage> bandwidthUsage() const;
+    /**
+     * Registers a device opened by somebody else, e.g. a file descriptor of a /dev/bus/usb node on Linux
+     * The device is already open when it is returned, its handle is closed by UsbDevice::close()
+     * but the file descriptor itself is left open, see libusb_wrap_sys_device()
+     * Without port information (e.g. no sysfs in a sandbox) the device is registered under a path made of its bus
+     * and device address, so every wrapped device gets its own entry; wrapping the same device twice replaces the first object
+     * @param sys_dev The platform specific device handle
+     * @param path Registers the device under the given path instead, e.g. the port path known by the broker
+     * @return On success a shared UsbDevice object is returned, otherwise nullptr and lastLibUsbError() may return a propriate error
+     */
+    UsbDevice_sptr_t wrapSysDevice(intptr_t sys_dev, const std::optional<UsbDevicePath>& path = std::nullopt);
     /**
      * This function is used for hotplug, should not be called directly
      */
@@ -165,17 +794,72 @@ public:
      */
     int32_t unregisterLibUsbDevice(libusb_device* device);
 private:
-    std::vector<UsbDeviceId> discoverDevicesIds();
     void discoverDevices();
     void closeDevices();    
+    bool acceptDevice(libusb_device* device, const UsbDeviceId& id, uint8_t device_class, const UsbDevicePath& path) const;
+    UsbDevice_sptr_t createDevice(libusb_device* device, bool apply_filter = true, const std::optional<UsbDevicePath>& known_path = std::nullopt) const;
+    void probeDevice(const UsbDevice_sptr_t& device) const;
+    void publishDevices(const std::vector<UsbDevice_sptr_t>& new_devices, bool probed);
+    void enumerateDevices(const std::vector<std::shared_ptr<libusb_device>>& found);
+    void removeDevices(const std::vector<std::pair<UsbDevicePath, libusb_device*>>& removed);
+    void rescanDevices();
+    void publishSnapshot(std::shared_ptr<UsbDeviceMap>&& devices);//mHotPlugMutex MUST be held
+    void loadIdentityCache();
+    void saveIdentityCache() const;
+    std::vector<UsbDevice_sptr_t> reclaimLostDevices(const std::vector<UsbDevice_sptr_t>& new_devices);
+    void loseDevice(const UsbDevice_sptr_t& device);//mHotPlugMutex MUST be held
+    void expireLostDevice(const UsbDevice_sptr_t& device);
+    struct LostDevice;
+    void reconnectDevice(const LostDevice& lost, const UsbDevice_sptr_t& fresh);
+    void postEvent(UsbDeviceEventType type, const UsbDevice_sptr_t& device, std::chrono::steady_clock::duration outage = {});
+    void flushEvents();
     //members
     libusb_context*                              mLibUsbContext;
-    int                                          mLibUsbHotPlugCbHandle;
+    std::vector<int>                             mLibUsbHotPlugCbHandles;
     std::atomic_int32_t                          mLastLibUsbError;
-    mutable std::mutex                           mHotPlugMutex;
-    std::map<UsbDeviceId, UsbDevice_sptr_t>      mDevices;
+    mutable std::mutex                           mHotPlugMutex;//serializes registry writers only
+    threading::RcuPointer<UsbDeviceMap>          mDevices;//writers hold mHotPlugMutex, readers take no lock
+    std::atomic<uint64_t>                        mRegistryEpoch;
+    mutable std::mutex                           mEpochMutex;
+    mutable std::condition_variable              mEpochCondVar;
     threading::Worker                            mWorker;
+    threading::ThreadPool                        mPool;//probing and other blocking device I/O
     std::function<void(const UsbDevice_sptr_t&)> mPluggedInCallback;
+    const UsbDeviceFilter                        mFilter;
+    const UsbDeviceEventCallback                 mEventCallback;
+    const std::chrono::milliseconds              mEventWindow;
+    std::mutex                                   mEventMutex;
+    std::vector<UsbDeviceEvent>                  mPendingEvents;
+    bool                                         mEventFlushScheduled;
+    const bool                                   mPrefetchStrings;
+    const std::function<void(const UsbDevice_sptr_t&)> mProbeCallback;
+    const uint32_t                               mProbeConcurrency;
+    const std::chrono::milliseconds              mProbeTimeout;
+    std::mutex                                   mEnumerationMutex;
+    bool                                         mEnumerating;
+    std::vector<std::shared_ptr<libusb_device>>  mEnumerated;
+    struct IdentityCacheEntry
+    {
+        uint64_t                                            hash;
+        std::array<std::optional<std::string>, 3>           strings;//manufacturer, product, serial number
+    };
+    const std::string                            mIdentityCachePath;
+    std::map<std::string, IdentityCacheEntry>    mIdentityCache;//by UsbDevicePath::toString(), read-only after loading
+    std::map<UsbDevicePath, std::shared_ptr<libusb_device>> mRescanIgnored;//filtered out devices, used by rescanDevices() only
+    const bool                                   mAutoDetachKernelDriver;
+    struct LostDevice
+    {
+        UsbDevice_sptr_t                                    device;
+        std::chrono::steady_clock::time_point               since;
+        std::optional<std::string>                          serial_number;//as cached when the device was lost
+    };
+    const bool                                   mTransparentReconnect;
+    const std::chrono::milliseconds              mReconnectTimeout;
+    std::mutex                                   mLostMutex;
+    std::map<UsbDevicePath, LostDevice>          mLostDevices;
+    std::map<UsbDevicePath, libusb_device*>      mReconnecting;//in-flight rebinds, the new device by path, guarded by mLostMutex
+    std::shared_ptr<UsbBandwidthBudget>          mBandwidthBudget;
+    std::shared_ptr<UsbDevice::Executor>         mExecutor;//shared with the devices to reach mPool and to keep the libusb context alive
 };
 
 #endif